@@ -0,0 +1,568 @@
+/* Times the code paths that have to stay fast on large installations,
+ * using synthetic data. Not installed, run it from the build directory:
+ *
+ *   ./xdg-app-benchmark summary [N_REFS]
+ *   ./xdg-app-benchmark deploy [N_FILES...]
+ *   ./xdg-app-benchmark export [N_DESKTOP_FILES]
+ */
+
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include "libgsystem.h"
+
+#include "xdg-app-dir.h"
+#include "xdg-app-utils.h"
+
+typedef struct {
+  const char *name;
+  gboolean (*fn) (int argc, char **argv, GCancellable *cancellable, GError **error);
+} BenchmarkCommand;
+
+static double
+elapsed_ms (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+static char *
+make_ref_name (int i)
+{
+  /* Zero padded, so the refs are generated in sorted order */
+  return g_strdup_printf ("app/org.example.App%06d/x86_64/master", i);
+}
+
+/* Writes a summary with n_refs refs to dir/summary, in the format
+   ostree generates */
+static gboolean
+write_summary (GFile *dir,
+               int n_refs,
+               GCancellable *cancellable,
+               GError **error)
+{
+  gs_unref_object GFile *summary_file = NULL;
+  gs_unref_variant GVariant *summary = NULL;
+  GVariantBuilder refs_builder;
+  GVariantBuilder extensions_builder;
+  int i, j;
+
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  for (i = 0; i < n_refs; i++)
+    {
+      gs_free char *ref = make_ref_name (i);
+      guint8 csum[32];
+
+      for (j = 0; j < sizeof (csum); j++)
+        csum[j] = g_random_int_range (0, 256);
+
+      g_variant_builder_add (&refs_builder, "(s(t@aya{sv}))", ref, (guint64)0,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, csum, sizeof (csum), 1),
+                             NULL);
+    }
+
+  g_variant_builder_init (&extensions_builder, G_VARIANT_TYPE_VARDICT);
+  summary = g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                               g_variant_builder_end (&refs_builder),
+                                               g_variant_builder_end (&extensions_builder)));
+
+  summary_file = g_file_get_child (dir, "summary");
+  return g_file_replace_contents (summary_file,
+                                  g_variant_get_data (summary), g_variant_get_size (summary),
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                  cancellable, error);
+}
+
+/* What ostree_repo_load_summary() used to do: a hash table of every
+   ref, with its checksum as a hex string */
+static GHashTable *
+load_summary_hash_table (GFile *dir,
+                         GError **error)
+{
+  gs_unref_object GFile *summary_file = NULL;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *summary = NULL;
+  gs_unref_variant GVariant *ref_list = NULL;
+  GMappedFile *mfile;
+  GHashTable *refs;
+  int i, n;
+
+  summary_file = g_file_get_child (dir, "summary");
+  mfile = g_mapped_file_new (gs_file_get_path_cached (summary_file), FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE));
+  ref_list = g_variant_get_child_value (summary, 0);
+
+  n = g_variant_n_children (ref_list);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *ref = NULL;
+      gs_unref_variant GVariant *csum_v = NULL;
+      char *refname;
+
+      ref = g_variant_get_child_value (ref_list, i);
+      g_variant_get (ref, "(&s(t@aya{sv}))", &refname, NULL, &csum_v, NULL);
+      g_hash_table_insert (refs, g_strdup (refname), ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  return refs;
+}
+
+static gboolean
+benchmark_summary (int argc,
+                   char **argv,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  gboolean ret = FALSE;
+  int n_refs = 100000;
+  int n_lookups = 1000;
+  gs_free char *tmpdir_path = NULL;
+  gs_unref_object GFile *tmpdir = NULL;
+  gs_unref_hashtable GHashTable *hash_table = NULL;
+  XdgAppSummary *summary = NULL;
+  XdgAppSummaryIter iter;
+  const char *ref;
+  const guint8 *csum;
+  int *lookups = NULL;
+  gint64 start;
+  int i, found, iterated;
+
+  if (argc > 1)
+    n_refs = atoi (argv[1]);
+  if (n_refs <= 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid number of refs");
+      goto out;
+    }
+
+  tmpdir_path = g_dir_make_tmp ("xdg-app-benchmark-XXXXXX", error);
+  if (tmpdir_path == NULL)
+    goto out;
+  tmpdir = g_file_new_for_path (tmpdir_path);
+
+  if (!write_summary (tmpdir, n_refs, cancellable, error))
+    goto out;
+
+  lookups = g_new (int, n_lookups);
+  for (i = 0; i < n_lookups; i++)
+    lookups[i] = g_random_int_range (0, n_refs);
+
+  g_print ("Summary with %d refs, %d lookups of random refs\n", n_refs, n_lookups);
+
+  start = g_get_monotonic_time ();
+  hash_table = load_summary_hash_table (tmpdir, error);
+  if (hash_table == NULL)
+    goto out;
+  g_print ("hash table: load %.3f ms", elapsed_ms (start));
+
+  start = g_get_monotonic_time ();
+  for (i = 0, found = 0; i < n_lookups; i++)
+    {
+      gs_free char *name = make_ref_name (lookups[i]);
+
+      if (g_hash_table_lookup (hash_table, name) != NULL)
+        found++;
+    }
+  g_print (", lookups %.3f ms (%d found)\n", elapsed_ms (start), found);
+
+  start = g_get_monotonic_time ();
+  summary = xdg_app_summary_load (tmpdir_path, NULL, cancellable, error);
+  if (summary == NULL)
+    goto out;
+  g_print ("mmapped summary: load %.3f ms", elapsed_ms (start));
+
+  start = g_get_monotonic_time ();
+  for (i = 0, found = 0; i < n_lookups; i++)
+    {
+      gs_free char *name = make_ref_name (lookups[i]);
+
+      if (xdg_app_summary_lookup_ref (summary, name, &csum))
+        found++;
+    }
+  g_print (", lookups %.3f ms (%d found)", elapsed_ms (start), found);
+
+  /* The first thousand refs, or all of them for small summaries */
+  start = g_get_monotonic_time ();
+  xdg_app_summary_iter_init (&iter, summary, "app/org.example.App000");
+  for (iterated = 0; xdg_app_summary_iter_next (&iter, &ref, &csum); )
+    iterated++;
+  g_print (", prefix iteration %.3f ms (%d refs)\n", elapsed_ms (start), iterated);
+
+  ret = TRUE;
+ out:
+  xdg_app_summary_free (summary);
+  g_free (lookups);
+  if (tmpdir)
+    gs_shutil_rm_rf (tmpdir, NULL, NULL);
+  return ret;
+}
+
+static gboolean
+write_file (GFile *root,
+            const char *path,
+            const char *contents,
+            GCancellable *cancellable,
+            GError **error)
+{
+  gs_unref_object GFile *file = g_file_resolve_relative_path (root, path);
+  gs_unref_object GFile *parent = g_file_get_parent (file);
+
+  if (!gs_file_ensure_directory (parent, TRUE, cancellable, error))
+    return FALSE;
+
+  return g_file_replace_contents (file, contents, strlen (contents), NULL, FALSE,
+                                  G_FILE_CREATE_NONE, NULL, cancellable, error);
+}
+
+/* Writes n_files small files with distinct contents below files/, in
+   directories of 256 files. Every change_every'th file depends on
+   version, so that a new version changes that share of them. */
+static gboolean
+write_files (GFile *root,
+             int n_files,
+             int change_every,
+             int version,
+             GCancellable *cancellable,
+             GError **error)
+{
+  int i;
+
+  for (i = 0; i < n_files; i++)
+    {
+      gs_free char *path = g_strdup_printf ("files/%04d/file%06d", i / 256, i);
+      gs_free char *contents = g_strdup_printf ("file %d version %d\n", i,
+                                                i % change_every == 0 ? version : 0);
+
+      if (!write_file (root, path, contents, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Commits the source directory to ref, on top of its current commit */
+static gboolean
+commit_dir (OstreeRepo *repo,
+            GFile *source,
+            const char *ref,
+            char **out_commit,
+            GCancellable *cancellable,
+            GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object OstreeMutableTree *mtree = NULL;
+  gs_unref_object GFile *root = NULL;
+  gs_free char *parent = NULL;
+
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &parent, error))
+    goto out;
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    goto out;
+
+  mtree = ostree_mutable_tree_new ();
+  if (!ostree_repo_write_directory_to_mtree (repo, source, mtree, NULL, cancellable, error))
+    goto out;
+
+  if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
+    goto out;
+
+  if (!ostree_repo_write_commit (repo, parent, "benchmark", NULL, NULL,
+                                 OSTREE_REPO_FILE (root), out_commit,
+                                 cancellable, error))
+    goto out;
+
+  ostree_repo_transaction_set_ref (repo, NULL, ref, *out_commit);
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  ostree_repo_abort_transaction (repo, cancellable, NULL);
+  return ret;
+}
+
+/* A per-user installation below tmpdir. Nothing is synced, so that
+   the timings don't depend on what else is on the filesystem. */
+static XdgAppDir *
+open_installation (GFile *tmpdir,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  gs_unref_object GFile *basedir = g_file_get_child (tmpdir, "installation");
+  XdgAppDir *dir;
+
+  dir = xdg_app_dir_new (basedir, TRUE);
+  xdg_app_dir_set_no_sync (dir, TRUE);
+
+  if (!xdg_app_dir_ensure_repo (dir, cancellable, error))
+    {
+      g_object_unref (dir);
+      return NULL;
+    }
+
+  return dir;
+}
+
+static gboolean
+time_deploy (XdgAppDir *dir,
+             const char *ref,
+             const char *commit,
+             double *out_ms,
+             GCancellable *cancellable,
+             GError **error)
+{
+  gs_unref_object GFile *deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
+  gint64 start;
+
+  if (!gs_file_ensure_directory (deploy_base, TRUE, cancellable, error))
+    return FALSE;
+
+  start = g_get_monotonic_time ();
+  if (!xdg_app_dir_deploy (dir, ref, commit, cancellable, error))
+    return FALSE;
+  *out_ms = elapsed_ms (start);
+
+  return TRUE;
+}
+
+static gboolean
+benchmark_deploy_files (int n_files,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  gboolean ret = FALSE;
+  const char *ref = "runtime/org.example.Platform/x86_64/master";
+  gs_free char *tmpdir_path = NULL;
+  gs_unref_object GFile *tmpdir = NULL;
+  gs_unref_object GFile *source = NULL;
+  gs_unref_object XdgAppDir *dir = NULL;
+  gs_free char *commit1 = NULL;
+  gs_free char *commit2 = NULL;
+  double checkout_ms, update_ms;
+
+  tmpdir_path = g_dir_make_tmp ("xdg-app-benchmark-XXXXXX", error);
+  if (tmpdir_path == NULL)
+    goto out;
+  tmpdir = g_file_new_for_path (tmpdir_path);
+  source = g_file_get_child (tmpdir, "source");
+
+  dir = open_installation (tmpdir, cancellable, error);
+  if (dir == NULL)
+    goto out;
+
+  if (!write_file (source, "metadata", "[Runtime]\nname=org.example.Platform\n", cancellable, error) ||
+      !write_files (source, n_files, 100, 1, cancellable, error) ||
+      !commit_dir (xdg_app_dir_get_repo (dir), source, ref, &commit1, cancellable, error))
+    goto out;
+
+  if (!write_files (source, n_files, 100, 2, cancellable, error) ||
+      !commit_dir (xdg_app_dir_get_repo (dir), source, ref, &commit2, cancellable, error))
+    goto out;
+
+  if (!time_deploy (dir, ref, commit1, &checkout_ms, cancellable, error) ||
+      !time_deploy (dir, ref, commit2, &update_ms, cancellable, error))
+    goto out;
+
+  g_print ("%d files: deploy %.3f ms, update of %d files %.3f ms\n",
+           n_files, checkout_ms, (n_files + 99) / 100, update_ms);
+
+  ret = TRUE;
+ out:
+  if (tmpdir)
+    gs_shutil_rm_rf (tmpdir, NULL, NULL);
+  return ret;
+}
+
+/* Deploys a runtime with each of the given numbers of files, and then
+   an update of it that changes 1% of them */
+static gboolean
+benchmark_deploy (int argc,
+                  char **argv,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  const char *default_counts[] = { "1000", "10000", NULL };
+  const char **counts = (const char **)argv + 1;
+  int i;
+
+  if (argc < 2)
+    counts = default_counts;
+
+  for (i = 0; counts[i] != NULL; i++)
+    {
+      int n_files = atoi (counts[i]);
+
+      if (n_files <= 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid number of files");
+          return FALSE;
+        }
+
+      if (!benchmark_deploy_files (n_files, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_desktop_files (GFile *root,
+                     const char *app,
+                     int n_files,
+                     int version,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+  int i;
+
+  for (i = 0; i < n_files; i++)
+    {
+      gs_free char *path = g_strdup_printf ("export/share/applications/%s.Desktop%06d.desktop", app, i);
+      gs_free char *contents = NULL;
+
+      contents = g_strdup_printf ("[Desktop Entry]\n"
+                                  "Version=1.0\n"
+                                  "Type=Application\n"
+                                  "Name=Example %d\n"
+                                  "Comment=Version %d\n"
+                                  "Exec=example --new-window %%U\n"
+                                  "TryExec=example\n"
+                                  "Icon=%s\n"
+                                  "Categories=Utility;\n"
+                                  "MimeType=text/plain;\n",
+                                  i, version, app);
+
+      if (!write_file (root, path, contents, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Deploys an app with n_files desktop files, then an update that
+   changes as many other files but none of the desktop files, so that
+   the rewritten ones are reused, and then an update that changes all
+   of the desktop files */
+static gboolean
+benchmark_export (int argc,
+                  char **argv,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  gboolean ret = FALSE;
+  const char *app = "org.example.App";
+  const char *ref = "app/org.example.App/x86_64/master";
+  int n_files = 2000;
+  gs_free char *tmpdir_path = NULL;
+  gs_unref_object GFile *tmpdir = NULL;
+  gs_unref_object GFile *source = NULL;
+  gs_unref_object XdgAppDir *dir = NULL;
+  gs_free char *commit1 = NULL;
+  gs_free char *commit2 = NULL;
+  gs_free char *commit3 = NULL;
+  double deploy_ms, unchanged_ms, changed_ms;
+
+  if (argc > 1)
+    n_files = atoi (argv[1]);
+  if (n_files <= 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid number of files");
+      goto out;
+    }
+
+  tmpdir_path = g_dir_make_tmp ("xdg-app-benchmark-XXXXXX", error);
+  if (tmpdir_path == NULL)
+    goto out;
+  tmpdir = g_file_new_for_path (tmpdir_path);
+  source = g_file_get_child (tmpdir, "source");
+
+  dir = open_installation (tmpdir, cancellable, error);
+  if (dir == NULL)
+    goto out;
+
+  if (!write_file (source, "metadata", "[Application]\nname=org.example.App\n", cancellable, error) ||
+      !write_files (source, n_files, 1, 1, cancellable, error) ||
+      !write_desktop_files (source, app, n_files, 1, cancellable, error) ||
+      !commit_dir (xdg_app_dir_get_repo (dir), source, ref, &commit1, cancellable, error))
+    goto out;
+
+  if (!write_files (source, n_files, 1, 2, cancellable, error) ||
+      !commit_dir (xdg_app_dir_get_repo (dir), source, ref, &commit2, cancellable, error))
+    goto out;
+
+  if (!write_desktop_files (source, app, n_files, 2, cancellable, error) ||
+      !commit_dir (xdg_app_dir_get_repo (dir), source, ref, &commit3, cancellable, error))
+    goto out;
+
+  if (!time_deploy (dir, ref, commit1, &deploy_ms, cancellable, error) ||
+      !time_deploy (dir, ref, commit2, &unchanged_ms, cancellable, error) ||
+      !time_deploy (dir, ref, commit3, &changed_ms, cancellable, error))
+    goto out;
+
+  g_print ("%d desktop files: deploy %.3f ms, update with unchanged desktop files %.3f ms, "
+           "update with changed desktop files %.3f ms\n",
+           n_files, deploy_ms, unchanged_ms, changed_ms);
+
+  ret = TRUE;
+ out:
+  if (tmpdir)
+    gs_shutil_rm_rf (tmpdir, NULL, NULL);
+  return ret;
+}
+
+static BenchmarkCommand commands[] = {
+  { "summary", benchmark_summary },
+  { "deploy", benchmark_deploy },
+  { "export", benchmark_export },
+  { NULL }
+};
+
+int
+main (int argc,
+      char **argv)
+{
+  BenchmarkCommand *command;
+  GError *error = NULL;
+
+  setlocale (LC_ALL, "");
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s BENCHMARK [ARGS...]\n", argv[0]);
+      return 1;
+    }
+
+  for (command = commands; command->name != NULL; command++)
+    {
+      if (strcmp (command->name, argv[1]) == 0)
+        break;
+    }
+
+  if (command->name == NULL)
+    {
+      g_printerr ("Unknown benchmark %s\n", argv[1]);
+      return 1;
+    }
+
+  if (!command->fn (argc - 1, argv + 1, NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  return 0;
+}
@@ -27,8 +27,10 @@ xdg_app_builtin_add_remote (int argc, char **argv, GCancellable *cancellable, GE
   gboolean ret = FALSE;
   gs_unref_object XdgAppDir *dir = NULL;
   gs_unref_variant_builder GVariantBuilder *optbuilder = NULL;
-  gs_unref_hashtable GHashTable *refs = NULL;
+  XdgAppSummary *summary = NULL;
   gs_free char *title = NULL;
+  gs_unref_object GFile *cache_dir = NULL;
+  GError *temp_error = NULL;
   const char *remote_name;
   const char *remote_url;
 
@@ -48,8 +50,23 @@ xdg_app_builtin_add_remote (int argc, char **argv, GCancellable *cancellable, GE
 
   optbuilder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
 
-  if (!ostree_repo_load_summary (remote_url, &refs, &title, cancellable, error))
-    goto out;
+  /* The summary is only needed for the title, and it also primes the
+     summary cache, but a remote without one is still usable */
+  cache_dir = xdg_app_dir_get_summary_cache_dir (dir);
+  summary = xdg_app_summary_load (remote_url, cache_dir, cancellable, &temp_error);
+  if (summary == NULL)
+    {
+      g_debug ("Can't load summary of %s: %s", remote_url, temp_error->message);
+      g_clear_error (&temp_error);
+    }
+  else
+    {
+      gs_unref_variant GVariant *title_v = NULL;
+
+      title_v = xdg_app_summary_lookup_extension (summary, "xa.title", G_VARIANT_TYPE_STRING);
+      if (title_v)
+        title = g_variant_dup_string (title_v, NULL);
+    }
 
   if (opt_no_gpg_verify)
     g_variant_builder_add (optbuilder, "{s@v}",
@@ -78,6 +95,7 @@ xdg_app_builtin_add_remote (int argc, char **argv, GCancellable *cancellable, GE
   ret = TRUE;
 
  out:
+  xdg_app_summary_free (summary);
   if (context)
     g_option_context_free (context);
   return ret;
@@ -118,6 +118,9 @@ xdg_app_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   gs_free char *body = NULL;
   OstreeRepoTransactionStats stats;
   OstreeRepoCommitModifier *modifier = NULL;
+  GVariantBuilder metadata_builder;
+  gs_unref_variant GVariant *commit_metadata = NULL;
+  guint64 installed_size, download_size;
 
   context = g_option_context_new ("LOCATION DIRECTORY NAME [BRANCH] - Create a repository from a build directory");
 
@@ -214,7 +217,16 @@ xdg_app_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     goto out;
 
-  if (!ostree_repo_write_commit (repo, parent, subject, body, NULL,
+  /* Recording the sizes lets clients estimate downloads cheaply */
+  if (!xdg_app_repo_collect_sizes (repo, root, &installed_size, &download_size,
+                                   cancellable, error))
+    goto out;
+
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE_VARDICT);
+  xdg_app_commit_metadata_add_sizes (&metadata_builder, installed_size, download_size);
+  commit_metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+
+  if (!ostree_repo_write_commit (repo, parent, subject, body, commit_metadata,
                                  OSTREE_REPO_FILE (root),
                                  &commit_checksum, cancellable, error))
     goto out;
@@ -230,6 +242,8 @@ xdg_app_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   g_print ("Content Total: %u\n", stats.content_objects_total);
   g_print ("Content Written: %u\n", stats.content_objects_written);
   g_print ("Content Bytes Written: %" G_GUINT64_FORMAT "\n", stats.content_bytes_written);
+  g_print ("Installed Size: %" G_GUINT64_FORMAT "\n", installed_size);
+  g_print ("Download Size: %" G_GUINT64_FORMAT "\n", download_size);
 
   ret = TRUE;
 
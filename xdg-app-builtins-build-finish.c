@@ -1,11 +1,17 @@
 #include "config.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include "libgsystem.h"
 
 #include "xdg-app-builtins.h"
@@ -20,22 +26,183 @@ static GOptionEntry options[] = {
   { NULL }
 };
 
-static GFile *show_export_base;
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
-static int
-show_export (const char *fpath, const struct stat *sb, int typeflag)
+/* Creates dest_name with the contents and mode of the regular file
+   src_name, sharing its data with a reflink where the filesystem
+   supports that, and copying it otherwise */
+static gboolean
+clone_file_at (int            src_dfd,
+               const char    *src_name,
+               struct stat   *src_stbuf,
+               int            dest_dfd,
+               const char    *dest_name,
+               GCancellable  *cancellable,
+               GError       **error)
 {
-  if (typeflag == FTW_F)
+  gboolean ret = FALSE;
+  gs_fd_close int src_fd = -1;
+  gs_fd_close int dest_fd = -1;
+
+  if (!gs_file_openat_noatime (src_dfd, src_name, &src_fd, cancellable, error))
+    goto out;
+
+  dest_fd = openat (dest_dfd, dest_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (dest_fd == -1)
     {
-      gs_unref_object GFile *file;
-      gs_free char *relpath;
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0)
+    {
+      gs_unref_object GInputStream *in = g_unix_input_stream_new (src_fd, FALSE);
+      gs_unref_object GOutputStream *out = g_unix_output_stream_new (dest_fd, FALSE);
+
+      if (g_output_stream_splice (out, in, 0, cancellable, error) < 0)
+        goto out;
+    }
 
-      file = g_file_new_for_path (fpath);
-      relpath = g_file_get_relative_path (show_export_base, file);
-      g_print ("Exporting %s\n", relpath);
+  if (fchmod (dest_fd, src_stbuf->st_mode & 07777) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
     }
 
-  return 0;
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Fills destination_name with hardlinks to the files below source_name,
+   so that exporting them takes no extra space, and prints what is
+   exported. Files that can't be hardlinked, e.g. because they belong
+   to someone else, are reflinked or copied. relpath is a buffer
+   holding the path of the directory below export/, it is restored
+   before returning. */
+static gboolean
+link_exports_dir (int            source_parent_fd,
+                  const char    *source_name,
+                  gboolean       follow,
+                  int            destination_parent_fd,
+                  const char    *destination_name,
+                  GString       *relpath,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  int res;
+  gs_dirfd_iterator_cleanup GSDirFdIterator source_iter;
+  gs_fd_close int destination_dfd = -1;
+  struct dirent *dent;
+  struct stat stbuf;
+  gsize relpath_len = relpath->len;
+
+  if (!gs_dirfd_iterator_init_at (source_parent_fd, source_name, follow, &source_iter, error))
+    goto out;
+
+  if (fstat (source_iter.fd, &stbuf) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  do
+    res = mkdirat (destination_parent_fd, destination_name, stbuf.st_mode & 07777);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1 && errno != EEXIST)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
+                               &destination_dfd,
+                               cancellable, error))
+    goto out;
+
+  while (TRUE)
+    {
+      if (!gs_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          int errsv = errno;
+          if (errsv == ENOENT)
+            continue;
+          else
+            {
+              gs_set_error_from_errno (error, errsv);
+              goto out;
+            }
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_string_append (relpath, dent->d_name);
+          g_string_append_c (relpath, '/');
+
+          if (!link_exports_dir (source_iter.fd, dent->d_name, FALSE,
+                                 destination_dfd, dent->d_name,
+                                 relpath, cancellable, error))
+            goto out;
+
+          g_string_truncate (relpath, relpath_len);
+          continue;
+        }
+
+      if (!S_ISREG (stbuf.st_mode) && !S_ISLNK (stbuf.st_mode))
+        {
+          g_warning ("Not exporting file %s%s of unsupported type\n", relpath->str, dent->d_name);
+          continue;
+        }
+
+      if (S_ISLNK (stbuf.st_mode))
+        {
+          char target[PATH_MAX + 1];
+          ssize_t len;
+
+          len = readlinkat (source_iter.fd, dent->d_name, target, sizeof (target) - 1);
+          if (len == -1)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+          target[len] = 0;
+
+          if (symlinkat (target, destination_dfd, dent->d_name) != 0)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
+      else if (linkat (source_iter.fd, dent->d_name, destination_dfd, dent->d_name, 0) != 0)
+        {
+          if (errno != EXDEV && errno != EMLINK && errno != EPERM)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+
+          if (!clone_file_at (source_iter.fd, dent->d_name, &stbuf,
+                              destination_dfd, dent->d_name,
+                              cancellable, error))
+            goto out;
+        }
+
+      g_print ("Exporting %s%s\n", relpath->str, dent->d_name);
+    }
+
+  ret = TRUE;
+ out:
+
+  return ret;
 }
 
 static gboolean
@@ -52,7 +219,6 @@ collect_exports (GFile *base, GCancellable *cancellable, GError **error)
     NULL,
   };
   int i;
-  const char *path;
 
   files = g_file_get_child (base, "files");
   export = g_file_get_child (base, "export");
@@ -69,24 +235,28 @@ collect_exports (GFile *base, GCancellable *cancellable, GError **error)
           g_debug ("Exporting from %s", paths[i]);
           gs_unref_object GFile *dest = NULL;
           gs_unref_object GFile *dest_parent = NULL;
+          GString *relpath;
+          gboolean linked;
+
           dest = g_file_resolve_relative_path (export, paths[i]);
           dest_parent = g_file_get_parent (dest);
           g_debug ("Ensuring export/%s parent exists", paths[i]);
           if (!gs_file_ensure_directory (dest_parent, TRUE, cancellable, error))
             goto out;
-          g_debug ("Copying from files/%s", paths[i]);
-          if (!gs_shutil_cp_a (src, dest, cancellable, error))
+          g_debug ("Linking from files/%s", paths[i]);
+          relpath = g_string_new (paths[i]);
+          g_string_append_c (relpath, '/');
+          linked = link_exports_dir (AT_FDCWD, gs_file_get_path_cached (src), TRUE,
+                                     AT_FDCWD, gs_file_get_path_cached (dest),
+                                     relpath, cancellable, error);
+          g_string_free (relpath, TRUE);
+          if (!linked)
             goto out;
         }
     }
 
-  path = g_file_get_path (export);
-  show_export_base = export;
-  ftw (path, show_export, 10);
-
   ret = TRUE;
 
-  g_assert_no_error (*error);
 out:
   return ret;
 }
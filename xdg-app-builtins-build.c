@@ -107,7 +107,7 @@ xdg_app_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
     goto out;
 
   app_files = g_file_get_child (app_deploy, "files");
-  runtime_files = g_file_get_child (runtime_deploy, "files");
+  runtime_files = xdg_app_get_deploy_files (runtime_deploy);
 
   argv_array = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (argv_array, g_strdup (HELPER));
@@ -11,87 +11,302 @@
 #include "xdg-app-utils.h"
 
 static char *opt_arch;
+static gboolean opt_dry_run;
+static gboolean opt_no_sync;
+static char **opt_subpaths;
+static char **opt_languages;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to install for", "ARCH" },
+  { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, "Only show how much would be downloaded and installed", NULL },
+  { "no-sync", 0, 0, G_OPTION_ARG_NONE, &opt_no_sync, "Don't sync anything to disk, unsafe if the system crashes", NULL },
   { NULL }
 };
 
-gboolean
-xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
+static GOptionEntry runtime_options[] = {
+  { "subpath", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_subpaths, "Only install this directory of the runtime", "PATH" },
+  { "language", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_languages, "Only install translations for this language", "LANG" },
+  { NULL }
+};
+
+/* Records the subset given with --subpath and --language for ref. The
+   subpaths are relative to the files of the runtime, which is what
+   ends up in /usr. */
+static gboolean
+set_subset (XdgAppDir    *dir,
+            const char   *ref,
+            GCancellable *cancellable,
+            GError      **error)
 {
-  gboolean ret = FALSE;
-  GOptionContext *context;
-  gs_unref_object XdgAppDir *dir = NULL;
-  gs_unref_object GFile *deploy_base = NULL;
-  gs_unref_object GFile *origin = NULL;
-  const char *repository;
-  const char *runtime;
-  const char *branch = "master";
-  gs_free char *ref = NULL;
-  gboolean created_deploy_base = FALSE;
+  gs_unref_ptrarray GPtrArray *subpaths = NULL;
+  int i;
 
-  context = g_option_context_new ("REPOSITORY RUNTIME [BRANCH] - Install a runtime");
+  if (opt_subpaths != NULL)
+    {
+      subpaths = g_ptr_array_new_with_free_func (g_free);
+      for (i = 0; opt_subpaths[i] != NULL; i++)
+        {
+          if (!g_path_is_absolute (opt_subpaths[i]))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Subpath %s is not absolute", opt_subpaths[i]);
+              return FALSE;
+            }
+
+          g_ptr_array_add (subpaths, g_build_filename ("/files", opt_subpaths[i], NULL));
+        }
+      g_ptr_array_add (subpaths, NULL);
+    }
 
-  if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
-    goto out;
+  return xdg_app_dir_set_subset (dir, ref,
+                                 subpaths ? (const char **)subpaths->pdata : NULL,
+                                 (const char **)opt_languages,
+                                 cancellable, error);
+}
 
-  if (argc < 3)
+/* Parses the refs to install into refs. A name and a branch can look
+   the same, e.g. "a.b.c", so the old "NAME BRANCH" form is only taken
+   for exactly two arguments without "//". Otherwise every argument is
+   a ref of its own, given as "NAME" for the default branch, or as
+   "NAME//BRANCH". */
+static gboolean
+parse_refs (const char *kind,
+            int         argc,
+            char      **argv,
+            GPtrArray  *refs,
+            GError    **error)
+{
+  gboolean ret = FALSE;
+  gboolean name_and_branch;
+  int i;
+
+  name_and_branch = argc == 2 &&
+    strstr (argv[0], "//") == NULL && strstr (argv[1], "//") == NULL;
+
+  for (i = 0; i < argc; i++)
     {
-      usage_error (context, "REPOSITORY and RUNTIME must be specified", error);
-      goto out;
+      gs_free char *name = NULL;
+      const char *branch = "master";
+      const char *separator = strstr (argv[i], "//");
+
+      if (separator != NULL)
+        {
+          name = g_strndup (argv[i], separator - argv[i]);
+          branch = separator + 2;
+        }
+      else
+        {
+          name = g_strdup (argv[i]);
+          if (name_and_branch)
+            branch = argv[++i];
+        }
+
+      if (!xdg_app_is_valid_name (name))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid %s name",
+                       name, strcmp (kind, "app") == 0 ? "application" : "runtime");
+          goto out;
+        }
+
+      if (!xdg_app_is_valid_branch (branch))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid branch name", branch);
+          goto out;
+        }
+
+      if (strcmp (kind, "app") == 0)
+        g_ptr_array_add (refs, xdg_app_build_app_ref (name, branch, opt_arch));
+      else
+        g_ptr_array_add (refs, xdg_app_build_runtime_ref (name, branch, opt_arch));
     }
 
-  repository = argv[1];
-  runtime  = argv[2];
-  if (argc >= 4)
-    branch = argv[3];
+  ret = TRUE;
+ out:
+  return ret;
+}
 
-  if (!xdg_app_is_valid_name (runtime))
+/* Adds a remote for the local repository at location, which is a path
+   or a file: uri, unless there is one already, so that updates work
+   like for any other remote. Local repositories are trusted, and
+   imported directly. */
+static gboolean
+ensure_local_remote (XdgAppDir    *dir,
+                     const char   *location,
+                     char        **out_remote,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *file = NULL;
+  gs_free char *uri = NULL;
+  gs_free char *hash = NULL;
+  gs_free char *remote = NULL;
+  GVariantBuilder builder;
+
+  file = g_file_new_for_commandline_arg (location);
+  if (!g_file_query_exists (file, cancellable))
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid runtime name", runtime);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Repository %s not found", location);
       goto out;
     }
 
-  if (!xdg_app_is_valid_branch (branch))
+  uri = g_file_get_uri (file);
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uri, -1);
+  remote = g_strdup_printf ("local-%.12s", hash);
+
+  if (!xdg_app_dir_ensure_repo (dir, cancellable, error))
+    goto out;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "gpg-verify",
+                         g_variant_new_variant (g_variant_new_boolean (FALSE)));
+
+  if (!ostree_repo_remote_change (xdg_app_dir_get_repo (dir), NULL,
+                                  OSTREE_REPO_REMOTE_CHANGE_ADD_IF_NOT_EXISTS,
+                                  remote, uri,
+                                  g_variant_builder_end (&builder),
+                                  cancellable, error))
+    goto out;
+
+  gs_transfer_out_value (out_remote, &remote);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Pulls all refs from the remote in one go, then deploys them and
+   updates the exports and runs the triggers once for the whole batch.
+   Refs installed with --subpath are pulled one by one instead, after
+   recording the subset to pull. */
+static gboolean
+install_refs (XdgAppDir    *dir,
+              const char   *repository,
+              GPtrArray    *refs,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *deploy_bases = NULL;
+  gboolean deployed_app = FALSE;
+  int i;
+
+  deploy_bases = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (i = 0; i < refs->len; i++)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid branch name", branch);
-      goto out;
+      const char *ref = g_ptr_array_index (refs, i);
+      GFile *deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
+
+      g_ptr_array_add (deploy_bases, deploy_base);
+
+      if (g_file_query_exists (deploy_base, cancellable))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s already installed", ref);
+          goto out;
+        }
     }
 
-  ref = xdg_app_build_runtime_ref (runtime, branch, opt_arch);
+  g_ptr_array_add (refs, NULL);
 
-  deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
-  if (g_file_query_exists (deploy_base, cancellable))
+  if (opt_dry_run)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Runtime %s branch %s already installed", runtime, branch);
+      ret = xdg_app_dir_estimate_pull (dir, repository, (const char **)refs->pdata,
+                                       NULL, cancellable, error);
       goto out;
     }
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (opt_subpaths == NULL &&
+      !xdg_app_dir_pull_refs (dir, repository, (const char **)refs->pdata,
+                              cancellable, error))
     goto out;
+  g_ptr_array_remove_index (refs, refs->len - 1);
 
-  if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
-    goto out;
-  created_deploy_base = TRUE;
+  for (i = 0; i < refs->len; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      GFile *deploy_base = g_ptr_array_index (deploy_bases, i);
+      gs_unref_object GFile *origin = NULL;
+
+      if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
+        goto out;
+
+      origin = g_file_get_child (deploy_base, "origin");
+      if (!g_file_replace_contents (origin, repository, strlen (repository), NULL, FALSE,
+                                    G_FILE_CREATE_NONE, NULL, cancellable, error) ||
+          !set_subset (dir, ref, cancellable, error) ||
+          (opt_subpaths != NULL &&
+           !xdg_app_dir_pull (dir, repository, ref, cancellable, error)) ||
+          !xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
+        {
+          gs_shutil_rm_rf (deploy_base, cancellable, NULL);
+          goto out;
+        }
+
+      if (g_str_has_prefix (ref, "app/"))
+        deployed_app = TRUE;
+    }
+
+  ret = TRUE;
 
-  origin = g_file_get_child (deploy_base, "origin");
-  if (!g_file_replace_contents (origin, repository, strlen (repository), NULL, FALSE,
-                                G_FILE_CREATE_NONE, NULL, cancellable, error))
+ out:
+  /* Whatever got deployed before a failure still needs its exports */
+  if (deployed_app)
+    {
+      if (ret)
+        ret = xdg_app_dir_update_exports (dir, cancellable, error);
+      else
+        xdg_app_dir_update_exports (dir, cancellable, NULL);
+    }
+
+  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+
+  return ret;
+}
+
+gboolean
+xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  gs_unref_object XdgAppDir *dir = NULL;
+  gs_unref_ptrarray GPtrArray *refs = NULL;
+  gs_free char *local_remote = NULL;
+  const char *repository;
+
+  context = g_option_context_new ("REPOSITORY RUNTIME [BRANCH] | REPOSITORY RUNTIME[//BRANCH]... - Install runtimes");
+  g_option_context_add_main_entries (context, runtime_options, NULL);
+
+  if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
     goto out;
 
-  if (!xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
+  if (opt_no_sync)
+    xdg_app_dir_set_no_sync (dir, TRUE);
+
+  if (argc < 3)
+    {
+      usage_error (context, "REPOSITORY and RUNTIME must be specified", error);
+      goto out;
+    }
+
+  repository = argv[1];
+  if (strchr (repository, '/') != NULL)
+    {
+      if (!ensure_local_remote (dir, repository, &local_remote, cancellable, error))
+        goto out;
+      repository = local_remote;
+    }
+
+  refs = g_ptr_array_new_with_free_func (g_free);
+  if (!parse_refs ("runtime", argc - 2, argv + 2, refs, error))
     goto out;
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  if (!install_refs (dir, repository, refs, cancellable, error))
+    goto out;
 
   ret = TRUE;
 
  out:
-  if (created_deploy_base && !ret)
-    gs_shutil_rm_rf (deploy_base, cancellable, NULL);
-
   if (context)
     g_option_context_free (context);
   return ret;
@@ -103,19 +318,18 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
   gboolean ret = FALSE;
   GOptionContext *context;
   gs_unref_object XdgAppDir *dir = NULL;
-  gs_unref_object GFile *deploy_base = NULL;
-  gs_unref_object GFile *origin = NULL;
+  gs_unref_ptrarray GPtrArray *refs = NULL;
+  gs_free char *local_remote = NULL;
   const char *repository;
-  const char *app;
-  const char *branch = "master";
-  gs_free char *ref = NULL;
-  gboolean created_deploy_base = FALSE;
 
-  context = g_option_context_new ("REPOSITORY APP [BRANCH] - Install an application");
+  context = g_option_context_new ("REPOSITORY APP [BRANCH] | REPOSITORY APP[//BRANCH]... - Install applications");
 
   if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
     goto out;
 
+  if (opt_no_sync)
+    xdg_app_dir_set_no_sync (dir, TRUE);
+
   if (argc < 3)
     {
       usage_error (context, "REPOSITORY and APP must be specified", error);
@@ -123,55 +337,23 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
     }
 
   repository = argv[1];
-  app  = argv[2];
-  if (argc >= 4)
-    branch = argv[3];
-
-  if (!xdg_app_is_valid_name (app))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid application name", app);
-      goto out;
-    }
-
-  if (!xdg_app_is_valid_branch (branch))
+  if (strchr (repository, '/') != NULL)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid branch name", branch);
-      goto out;
+      if (!ensure_local_remote (dir, repository, &local_remote, cancellable, error))
+        goto out;
+      repository = local_remote;
     }
 
-  ref = xdg_app_build_app_ref (app, branch, opt_arch);
-
-  deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
-  if (g_file_query_exists (deploy_base, cancellable))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "App %s branch %s already installed", app, branch);
-      goto out;
-    }
-
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  refs = g_ptr_array_new_with_free_func (g_free);
+  if (!parse_refs ("app", argc - 2, argv + 2, refs, error))
     goto out;
 
-  if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
+  if (!install_refs (dir, repository, refs, cancellable, error))
     goto out;
-  created_deploy_base = TRUE;
-
-  origin = g_file_get_child (deploy_base, "origin");
-  if (!g_file_replace_contents (origin, repository, strlen (repository), NULL, FALSE,
-                                G_FILE_CREATE_NONE, NULL, cancellable, error))
-    goto out;
-
-  if (!xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
-    goto out;
-
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
 
   ret = TRUE;
 
  out:
-  if (created_deploy_base && !ret)
-    gs_shutil_rm_rf (deploy_base, cancellable, NULL);
-
   if (context)
     g_option_context_free (context);
   return ret;
@@ -89,7 +89,21 @@ print_installed_refs (XdgAppDir *dir, const char *kind, GCancellable *cancellabl
               branch = g_file_info_get_name (child_info3);
 
               if (opt_show_details)
-                ref = g_strdup_printf ("%s/%s/%s", name, arch, branch);
+                {
+                  gs_free char *full_ref = g_strdup_printf ("%s/%s/%s/%s", kind, name, arch, branch);
+                  gs_unref_variant GVariant *deploy_data = NULL;
+
+                  deploy_data = xdg_app_dir_get_deploy_data (dir, full_ref, NULL, cancellable, NULL);
+                  if (deploy_data != NULL)
+                    {
+                      gs_free char *size = g_format_size (xdg_app_deploy_data_get_installed_size (deploy_data));
+
+                      ref = g_strdup_printf ("%s/%s/%s\t%.12s\t%s", name, arch, branch,
+                                             xdg_app_deploy_data_get_commit (deploy_data), size);
+                    }
+                  else
+                    ref = g_strdup_printf ("%s/%s/%s", name, arch, branch);
+                }
               else
                 ref = g_strdup (name);
 
@@ -103,7 +117,7 @@ print_installed_refs (XdgAppDir *dir, const char *kind, GCancellable *cancellabl
 		    }
                 }
 	      if (found)
-		g_free (refs);
+		g_free (ref);
 	      else
                 g_ptr_array_add (refs, ref);
 
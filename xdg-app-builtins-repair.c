@@ -0,0 +1,149 @@
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "libgsystem.h"
+
+#include "xdg-app-builtins.h"
+#include "xdg-app-utils.h"
+
+static gboolean opt_fast;
+static gboolean opt_dry_run;
+static gboolean opt_verify_exports;
+
+static GOptionEntry options[] = {
+  { "fast", 0, 0, G_OPTION_ARG_NONE, &opt_fast, "Only check sizes, and the modification times of copied files", NULL },
+  { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, "Only show damaged files, don't repair them", NULL },
+  { "verify-exports", 0, 0, G_OPTION_ARG_NONE, &opt_verify_exports, "Also remove dangling and restore missing exported files", NULL },
+  { NULL }
+};
+
+static gboolean
+repair_ref (XdgAppDir    *dir,
+            const char   *ref,
+            guint        *n_deployments,
+            guint        *n_files,
+            guint        *n_damaged,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_strfreev char **deployed = NULL;
+  XdgAppDirRepairFlags flags = XDG_APP_DIR_REPAIR_FLAGS_NONE;
+  int i, j;
+
+  if (opt_fast)
+    flags |= XDG_APP_DIR_REPAIR_FLAGS_FAST;
+  if (opt_dry_run)
+    flags |= XDG_APP_DIR_REPAIR_FLAGS_DRY_RUN;
+
+  if (!xdg_app_dir_list_deployed (dir, ref, &deployed, cancellable, error))
+    goto out;
+
+  for (i = 0; deployed[i] != NULL; i++)
+    {
+      gs_strfreev char **damaged = NULL;
+      guint deployment_files;
+
+      g_debug ("Verifying %s commit %s", ref, deployed[i]);
+
+      if (!xdg_app_dir_repair_deployment (dir, ref, deployed[i], flags,
+                                          &deployment_files, &damaged,
+                                          cancellable, error))
+        {
+          g_prefix_error (error, "While verifying %s commit %s: ", ref, deployed[i]);
+          goto out;
+        }
+
+      for (j = 0; damaged[j] != NULL; j++)
+        g_print ("%s %s: %s %s\n", opt_dry_run ? "Damaged" : "Repaired",
+                 ref, deployed[i], damaged[j]);
+
+      *n_deployments += 1;
+      *n_files += deployment_files;
+      *n_damaged += j;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+gboolean
+xdg_app_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  gs_unref_object XdgAppDir *dir = NULL;
+  const char *kinds[] = { "runtime", "app" };
+  guint n_deployments = 0;
+  guint n_files = 0;
+  guint n_damaged = 0;
+  int i, k;
+
+  context = g_option_context_new ("[REF...] - Verify and repair installed applications and runtimes");
+
+  if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
+    goto out;
+
+  if (opt_verify_exports && opt_dry_run)
+    {
+      usage_error (context, "--verify-exports can't be used with --dry-run", error);
+      goto out;
+    }
+
+  if (argc > 1)
+    {
+      for (i = 1; i < argc; i++)
+        {
+          gs_unref_object GFile *deploy_base = xdg_app_dir_get_deploy_dir (dir, argv[i]);
+
+          if (!g_file_query_exists (deploy_base, cancellable))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s not installed", argv[i]);
+              goto out;
+            }
+
+          if (!repair_ref (dir, argv[i], &n_deployments, &n_files, &n_damaged,
+                           cancellable, error))
+            goto out;
+        }
+    }
+  else
+    {
+      for (k = 0; k < G_N_ELEMENTS (kinds); k++)
+        {
+          gs_strfreev char **refs = NULL;
+
+          if (!xdg_app_dir_list_refs (dir, kinds[k], &refs, cancellable, error))
+            goto out;
+
+          for (i = 0; refs[i] != NULL; i++)
+            {
+              if (!repair_ref (dir, refs[i], &n_deployments, &n_files, &n_damaged,
+                               cancellable, error))
+                goto out;
+            }
+        }
+    }
+
+  g_print ("Verified %u files in %u deployments, %u damaged\n",
+           n_files, n_deployments, n_damaged);
+
+  if (opt_verify_exports &&
+      !xdg_app_dir_verify_exports (dir, cancellable, error))
+    goto out;
+
+  if (!opt_dry_run && (n_damaged > 0 || opt_verify_exports) &&
+      !xdg_app_dir_update_exports (dir, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
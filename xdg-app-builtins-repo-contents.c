@@ -30,16 +30,15 @@ xdg_app_builtin_repo_contents (int argc, char **argv, GCancellable *cancellable,
   GOptionContext *context;
   gs_unref_object XdgAppDir *dir = NULL;
   OstreeRepo *repo = NULL;
-  gs_unref_hashtable GHashTable *refs = NULL;
-  gs_free char *title = NULL;
-  GHashTableIter iter;
-  gpointer key;
-  gpointer value;
+  XdgAppSummary *summary = NULL;
+  XdgAppSummaryIter iter;
+  const char *refspec;
+  const guint8 *csum;
   gs_unref_ptrarray GPtrArray *names = NULL;
   int i;
   const char *repository;
   gs_free char *url = NULL;
-  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_object GFile *cache_dir = NULL;
 
   context = g_option_context_new (" REPOSITORY - Show available runtimes and applications");
 
@@ -58,16 +57,16 @@ xdg_app_builtin_repo_contents (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_remote_get_url (repo, repository, &url, error))
     goto out;
 
-  if (!ostree_repo_load_summary (url, &refs, &title, cancellable, error))
+  cache_dir = xdg_app_dir_get_summary_cache_dir (dir);
+  summary = xdg_app_summary_load (url, cache_dir, cancellable, error);
+  if (summary == NULL)
     goto out;
 
   names = g_ptr_array_new_with_free_func (g_free);
 
-  g_hash_table_iter_init (&iter, refs);
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  xdg_app_summary_iter_init (&iter, summary, NULL);
+  while (xdg_app_summary_iter_next (&iter, &refspec, &csum))
     {
-      const char *refspec = key;
-      const char *checksum = value;
       gs_free char *remote = NULL;
       gs_free char *ref = NULL;
       char *name = NULL;
@@ -82,11 +81,13 @@ xdg_app_builtin_repo_contents (int argc, char **argv, GCancellable *cancellable,
       if (opt_only_updates)
         {
           gs_free char *deployed = NULL;
+          char checksum[65];
 
           deployed = xdg_app_dir_read_active (dir, ref, cancellable);
           if (deployed == NULL)
             continue;
 
+          ostree_checksum_inplace_from_bytes (csum, checksum);
           if (g_strcmp0 (deployed, checksum) == 0)
             continue;
         }
@@ -147,6 +148,7 @@ xdg_app_builtin_repo_contents (int argc, char **argv, GCancellable *cancellable,
   ret = TRUE;
 
  out:
+  xdg_app_summary_free (summary);
   if (context)
     g_option_context_free (context);
 
@@ -11,12 +11,342 @@
 #include "xdg-app-utils.h"
 
 static char *opt_title;
+static gboolean opt_generate_deltas;
+static int opt_delta_jobs;
+static int opt_delta_min_size = 64;
 
 static GOptionEntry options[] = {
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, "A nice name to use for this repository", "TITLE" },
+  { "generate-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_generate_deltas, "Generate delta files", NULL },
+  { "static-delta-jobs", 0, 0, G_OPTION_ARG_INT, &opt_delta_jobs, "Number of deltas to generate in parallel", "NUM" },
+  { "static-delta-min-size", 0, 0, G_OPTION_ARG_INT, &opt_delta_min_size, "Skip deltas for updates smaller than this (default 64)", "KB" },
   { NULL }
 };
 
+typedef struct {
+  GFile *repofile;
+  GMutex lock;
+  GError *error;
+  GCancellable *cancellable;
+} DeltaContext;
+
+typedef struct {
+  char *ref;
+  char *from;
+  char *to;
+  char *name;
+} DeltaJob;
+
+static void
+delta_job_free (DeltaJob *job)
+{
+  g_free (job->ref);
+  g_free (job->from);
+  g_free (job->to);
+  g_free (job->name);
+  g_free (job);
+}
+
+/* Returns the total stored size of the objects of commit to that are
+   not in commit from, i.e. what a client has to download without a
+   delta. Only the two commits count, not their history. */
+static gboolean
+get_update_size (OstreeRepo   *repo,
+                 const char   *from,
+                 const char   *to,
+                 guint64      *out_size,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *from_reachable = NULL;
+  gs_unref_hashtable GHashTable *to_reachable = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  guint64 size = 0;
+
+  to_reachable = ostree_repo_traverse_new_reachable ();
+  if (!ostree_repo_traverse_commit (repo, to, 0, to_reachable, cancellable, error))
+    goto out;
+
+  if (from)
+    {
+      from_reachable = ostree_repo_traverse_new_reachable ();
+      if (!ostree_repo_traverse_commit (repo, from, 0, from_reachable, cancellable, error))
+        goto out;
+    }
+
+  g_hash_table_iter_init (&iter, to_reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      GVariant *object = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 object_size;
+
+      if (from_reachable && g_hash_table_contains (from_reachable, object))
+        continue;
+
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (!ostree_repo_query_object_storage_size (repo, objtype, checksum,
+                                                  &object_size, cancellable, error))
+        goto out;
+
+      size += object_size;
+    }
+
+  *out_size = size;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+generate_delta (DeltaJob     *job,
+                DeltaContext *context,
+                GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object OstreeRepo *repo = NULL;
+  guint64 size;
+
+  /* Repo objects are not thread safe, so every job opens its own */
+  repo = ostree_repo_new (context->repofile);
+  if (!ostree_repo_open (repo, context->cancellable, error))
+    goto out;
+
+  if (!get_update_size (repo, job->from, job->to, &size, context->cancellable, error))
+    goto out;
+
+  if (size < (guint64)opt_delta_min_size * 1024)
+    {
+      g_debug ("Skipping delta %s for %s, only %" G_GUINT64_FORMAT " bytes", job->name, job->ref, size);
+      ret = TRUE;
+      goto out;
+    }
+
+  g_print ("Generating delta %s for %s\n", job->name, job->ref);
+
+  if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                          job->from, job->to, NULL, NULL,
+                                          context->cancellable, error))
+    {
+      g_prefix_error (error, "Generating delta %s for %s: ", job->name, job->ref);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+generate_delta_thread (gpointer data,
+                       gpointer user_data)
+{
+  DeltaJob *job = data;
+  DeltaContext *context = user_data;
+  GError *temp_error = NULL;
+
+  if (!g_cancellable_is_cancelled (context->cancellable) &&
+      !generate_delta (job, context, &temp_error))
+    {
+      g_mutex_lock (&context->lock);
+      if (context->error == NULL)
+        {
+          context->error = temp_error;
+          temp_error = NULL;
+          /* No point in finishing the others */
+          g_cancellable_cancel (context->cancellable);
+        }
+      g_mutex_unlock (&context->lock);
+      g_clear_error (&temp_error);
+    }
+
+  delta_job_free (job);
+}
+
+static void
+queue_delta (GThreadPool *pool,
+             GHashTable  *existing,
+             const char  *ref,
+             const char  *from,
+             const char  *to)
+{
+  DeltaJob *job;
+  char *name;
+
+  if (from)
+    name = g_strconcat (from, "-", to, NULL);
+  else
+    name = g_strdup (to);
+
+  /* Deltas are identified by their commits, so existing ones are still
+     valid and don't need to be regenerated */
+  if (g_hash_table_contains (existing, name))
+    {
+      g_free (name);
+      return;
+    }
+  g_hash_table_add (existing, name);
+
+  job = g_new0 (DeltaJob, 1);
+  job->ref = g_strdup (ref);
+  job->from = g_strdup (from);
+  job->to = g_strdup (to);
+  job->name = g_strdup (name);
+
+  g_thread_pool_push (pool, job, NULL);
+}
+
+/* Generates a delta from scratch and one from the parent commit for
+   the tip of every ref. ostree lists all deltas of the repository in
+   the summary when it is regenerated. */
+static gboolean
+generate_deltas (GFile         *repofile,
+                 OstreeRepo    *repo,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *refs = NULL;
+  gs_unref_hashtable GHashTable *existing = NULL;
+  gs_unref_ptrarray GPtrArray *delta_names = NULL;
+  gs_unref_object GCancellable *jobs_cancellable = NULL;
+  GThreadPool *pool = NULL;
+  DeltaContext context = { NULL };
+  GHashTableIter iter;
+  gpointer key, value;
+  int n_jobs;
+  int i;
+
+  if (!ostree_repo_list_refs (repo, NULL, &refs, cancellable, error))
+    goto out;
+
+  if (!ostree_repo_list_static_delta_names (repo, &delta_names, cancellable, error))
+    goto out;
+
+  existing = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < delta_names->len; i++)
+    g_hash_table_add (existing, g_strdup (g_ptr_array_index (delta_names, i)));
+
+  jobs_cancellable = g_cancellable_new ();
+
+  context.repofile = repofile;
+  context.cancellable = jobs_cancellable;
+  g_mutex_init (&context.lock);
+
+  n_jobs = opt_delta_jobs > 0 ? opt_delta_jobs : g_get_num_processors ();
+  pool = g_thread_pool_new (generate_delta_thread, &context, n_jobs, FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *commit = value;
+      gs_unref_variant GVariant *commit_v = NULL;
+      gs_free char *parent = NULL;
+
+      queue_delta (pool, existing, ref, NULL, commit);
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_v, error))
+        goto out;
+
+      /* The parent is not necessarily in the repo */
+      parent = ostree_commit_get_parent (commit_v);
+      if (parent != NULL)
+        {
+          gs_unref_variant GVariant *parent_v = NULL;
+
+          if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, parent, &parent_v, error))
+            goto out;
+
+          if (parent_v != NULL)
+            queue_delta (pool, existing, ref, parent, commit);
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (pool)
+    {
+      /* Cancel outstanding jobs if we failed while queuing */
+      if (!ret)
+        g_cancellable_cancel (jobs_cancellable);
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+  if (ret && context.error)
+    {
+      g_propagate_error (error, context.error);
+      context.error = NULL;
+      ret = FALSE;
+    }
+  g_clear_error (&context.error);
+  g_mutex_clear (&context.lock);
+
+  return ret;
+}
+
+
+/* Collects the installed and download size of the tip of every ref,
+   so that clients can estimate an install or update from the summary
+   alone. The sizes are taken from the commit metadata where build-export
+   recorded them. */
+static gboolean
+collect_ref_sizes (OstreeRepo    *repo,
+                   GVariant     **out_sizes,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *refs = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(tt)}"));
+
+  if (!ostree_repo_list_refs (repo, NULL, &refs, cancellable, error))
+    goto out;
+
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *commit = value;
+      gs_unref_variant GVariant *commit_v = NULL;
+      guint64 installed_size, download_size;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_v, error))
+        goto out;
+
+      if (!xdg_app_commit_get_sizes (commit_v, &installed_size, &download_size))
+        {
+          gs_unref_object GFile *root = NULL;
+
+          if (!ostree_repo_read_commit (repo, commit, &root, NULL, cancellable, error) ||
+              !xdg_app_repo_collect_sizes (repo, root, &installed_size, &download_size,
+                                           cancellable, error))
+            goto out;
+        }
+
+      g_variant_builder_add (&builder, "{s(tt)}", ref,
+                             GUINT64_TO_BE (installed_size),
+                             GUINT64_TO_BE (download_size));
+    }
+
+  *out_sizes = g_variant_builder_end (&builder);
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_variant_builder_clear (&builder);
+  return ret;
+}
 
 gboolean
 xdg_app_builtin_repo_update (int argc, char **argv, GCancellable *cancellable, GError **error)
@@ -26,6 +356,8 @@ xdg_app_builtin_repo_update (int argc, char **argv, GCancellable *cancellable, G
   gs_unref_object GFile *repofile = NULL;
   gs_unref_object OstreeRepo *repo = NULL;
   const char *location;
+  GVariantBuilder builder;
+  GVariant *sizes = NULL;
   GVariant *extra = NULL;
 
   context = g_option_context_new ("LOCATION - Update repository metadata");
@@ -47,14 +379,21 @@ xdg_app_builtin_repo_update (int argc, char **argv, GCancellable *cancellable, G
   if (!ostree_repo_open (repo, cancellable, error))
     goto out;
 
+  if (opt_generate_deltas &&
+      !generate_deltas (repofile, repo, cancellable, error))
+    goto out;
+
+  if (!collect_ref_sizes (repo, &sizes, cancellable, error))
+    goto out;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
   if (opt_title)
-    {
-      GVariantBuilder builder;
+    g_variant_builder_add (&builder, "{sv}", "xa.title", g_variant_new_string (opt_title));
 
-      g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
-      g_variant_builder_add (&builder, "{sv}", "xa.title", g_variant_new_string (opt_title));
-      extra = g_variant_builder_end (&builder);
-    }
+  g_variant_builder_add (&builder, "{sv}", "xa.sizes", sizes);
+
+  extra = g_variant_builder_end (&builder);
 
   if (!ostree_repo_regenerate_summary (repo, extra, cancellable, error))
     goto out;
@@ -0,0 +1,140 @@
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "libgsystem.h"
+
+#include "xdg-app-builtins.h"
+#include "xdg-app-utils.h"
+
+static char *opt_arch;
+static char *opt_commit;
+static gboolean opt_runtime;
+
+static GOptionEntry options[] = {
+  { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to roll back", "ARCH" },
+  { "commit", 0, 0, G_OPTION_ARG_STRING, &opt_commit, "Deployed commit to switch to", "COMMIT" },
+  { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, "Roll back a runtime instead of an application", NULL },
+  { NULL }
+};
+
+gboolean
+xdg_app_builtin_rollback (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  gs_unref_object XdgAppDir *dir = NULL;
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_strfreev char **deployed = NULL;
+  gs_free char *active = NULL;
+  const char *name;
+  const char *branch;
+  const char *arch;
+  gs_free char *ref = NULL;
+  const char *checksum = NULL;
+  int i;
+
+  context = g_option_context_new ("NAME [BRANCH] - Switch back to an earlier deployed version");
+
+  if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
+    goto out;
+
+  if (argc < 2)
+    {
+      usage_error (context, "NAME must be specified", error);
+      goto out;
+    }
+
+  name = argv[1];
+  if (argc > 2)
+    branch = argv[2];
+  else
+    branch = "master";
+  if (opt_arch)
+    arch = opt_arch;
+  else
+    arch = xdg_app_get_arch ();
+
+  if (!xdg_app_is_valid_name (name))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid %s name",
+                   name, opt_runtime ? "runtime" : "application");
+      goto out;
+    }
+
+  if (!xdg_app_is_valid_branch (branch))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' is not a valid branch name", branch);
+      goto out;
+    }
+
+  if (opt_runtime)
+    ref = xdg_app_build_runtime_ref (name, branch, arch);
+  else
+    ref = xdg_app_build_app_ref (name, branch, arch);
+
+  deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
+  if (!g_file_query_exists (deploy_base, cancellable))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s not installed", ref);
+      goto out;
+    }
+
+  if (!xdg_app_dir_list_deployed_by_age (dir, ref, &deployed, cancellable, error))
+    goto out;
+
+  active = xdg_app_dir_read_active (dir, ref, cancellable);
+
+  if (opt_commit)
+    {
+      for (i = 0; deployed[i] != NULL; i++)
+        {
+          if (strcmp (deployed[i], opt_commit) == 0)
+            checksum = deployed[i];
+        }
+
+      if (checksum == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "%s commit %s is not deployed", ref, opt_commit);
+          goto out;
+        }
+    }
+  else
+    {
+      /* The newest deployment older than the active one */
+      for (i = 0; deployed[i] != NULL; i++)
+        {
+          if (g_strcmp0 (deployed[i], active) == 0)
+            {
+              checksum = deployed[i + 1];
+              break;
+            }
+        }
+
+      if (checksum == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No earlier deployment of %s is kept", ref);
+          goto out;
+        }
+    }
+
+  g_print ("Activating %s commit %s\n", ref, checksum);
+
+  if (!xdg_app_dir_set_active (dir, ref, checksum, cancellable, error))
+    goto out;
+
+  if (!opt_runtime &&
+      !xdg_app_dir_update_exports (dir, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
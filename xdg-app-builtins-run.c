@@ -50,7 +50,7 @@ add_extension_arg (const char *directory,
   deploy = xdg_app_find_deploy_dir_for_ref (extension_ref, cancellable, NULL);
   if (deploy != NULL)
     {
-      gs_unref_object GFile *files = g_file_get_child (deploy, "files");
+      gs_unref_object GFile *files = xdg_app_get_deploy_files (deploy);
       g_ptr_array_add (argv_array, g_strdup ("-b"));
       g_ptr_array_add (argv_array, g_strdup_printf ("%s=%s", full_directory, gs_file_get_path_cached (files)));
     }
@@ -118,6 +118,43 @@ add_extension_args (GKeyFile *metakey, const char *full_ref,
 }
 
 
+/* Uses the metadata recorded when deploying, and only reads the
+   metadata file of deployments made before that. */
+static GKeyFile *
+load_deploy_metadata (GFile *deploy,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  gs_unref_keyfile GKeyFile *metakey = NULL;
+  gs_unref_variant GVariant *deploy_data = NULL;
+  GKeyFile *ret = NULL;
+
+  metakey = g_key_file_new ();
+
+  deploy_data = xdg_app_load_deploy_data (deploy, cancellable, NULL);
+  if (deploy_data != NULL)
+    {
+      if (!g_key_file_load_from_data (metakey, xdg_app_deploy_data_get_metadata (deploy_data),
+                                      -1, 0, error))
+        goto out;
+    }
+  else
+    {
+      gs_unref_object GFile *metadata = NULL;
+      gs_free char *metadata_contents = NULL;
+      gsize metadata_size;
+
+      metadata = g_file_get_child (deploy, "metadata");
+      if (!g_file_load_contents (metadata, cancellable, &metadata_contents, &metadata_size, NULL, error) ||
+          !g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, error))
+        goto out;
+    }
+
+  ret = g_key_file_ref (metakey);
+ out:
+  return ret;
+}
+
 gboolean
 xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -133,11 +170,7 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   gs_unref_object GFile *app_files = NULL;
   gs_unref_object GFile *runtime_deploy = NULL;
   gs_unref_object GFile *runtime_files = NULL;
-  gs_unref_object GFile *metadata = NULL;
-  gs_unref_object GFile *runtime_metadata = NULL;
   gs_unref_object XdgAppSessionHelper *session_helper = NULL;
-  gs_free char *metadata_contents = NULL;
-  gs_free char *runtime_metadata_contents = NULL;
   gs_free char *runtime = NULL;
   gs_free char *default_command = NULL;
   gs_free char *runtime_ref = NULL;
@@ -149,7 +182,6 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   gs_free_error GError *my_error2 = NULL;
   gs_unref_ptrarray GPtrArray *argv_array = NULL;
   gs_free char *monitor_path = NULL;
-  gsize metadata_size, runtime_metadata_size;
   const char *app;
   const char *branch = "master";
   const char *command = "/bin/sh";
@@ -208,12 +240,8 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   path = g_file_get_path (app_deploy);
   g_debug ("Running application in %s", path);
 
-  metadata = g_file_get_child (app_deploy, "metadata");
-  if (!g_file_load_contents (metadata, cancellable, &metadata_contents, &metadata_size, NULL, error))
-    goto out;
-
-  metakey = g_key_file_new ();
-  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, error))
+  metakey = load_deploy_metadata (app_deploy, cancellable, error);
+  if (metakey == NULL)
     goto out;
 
   argv_array = g_ptr_array_new_with_free_func (g_free);
@@ -242,17 +270,20 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   path = g_file_get_path (runtime_deploy);
   g_debug ("Using runtime in %s", path);
 
-  runtime_metadata = g_file_get_child (runtime_deploy, "metadata");
-  if (g_file_load_contents (runtime_metadata, cancellable, &runtime_metadata_contents, &runtime_metadata_size, NULL, NULL))
+  runtime_metakey = load_deploy_metadata (runtime_deploy, cancellable, &my_error);
+  if (runtime_metakey == NULL)
     {
-
-      runtime_metakey = g_key_file_new ();
-      if (!g_key_file_load_from_data (runtime_metakey, runtime_metadata_contents, runtime_metadata_size, 0, error))
-	goto out;
-
-      if (!add_extension_args (runtime_metakey, runtime_ref, argv_array, cancellable, error))
-	goto out;
+      /* Runtimes don't need to have metadata */
+      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, my_error);
+          my_error = NULL;
+          goto out;
+        }
+      g_clear_error (&my_error);
     }
+  else if (!add_extension_args (runtime_metakey, runtime_ref, argv_array, cancellable, error))
+    goto out;
 
   if (!xdg_app_dir_ensure_path (user_dir, cancellable, error))
     goto out;
@@ -280,8 +311,8 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       goto out;
     }
 
-  app_files = g_file_get_child (app_deploy, "files");
-  runtime_files = g_file_get_child (runtime_deploy, "files");
+  app_files = xdg_app_get_deploy_files (app_deploy);
+  runtime_files = xdg_app_get_deploy_files (runtime_deploy);
 
   default_command = g_key_file_get_string (metakey, "Application", "command", error);
   if (*error)
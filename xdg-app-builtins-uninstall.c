@@ -51,6 +51,34 @@ out:
   return ret;
 }
 
+/* Checks the deploy data of the deployments for exported files, so
+   the exports only need to be updated when there were any */
+static gboolean
+deployments_have_exports (XdgAppDir *dir,
+                          const char *ref,
+                          char **deployed,
+                          GCancellable *cancellable)
+{
+  int i;
+
+  for (i = 0; deployed[i] != NULL; i++)
+    {
+      gs_unref_variant GVariant *deploy_data = NULL;
+      gs_free const char **exports = NULL;
+
+      /* Deployments made by older versions don't list their exports */
+      deploy_data = xdg_app_dir_get_deploy_data (dir, ref, deployed[i], cancellable, NULL);
+      if (deploy_data == NULL)
+        return TRUE;
+
+      exports = xdg_app_deploy_data_get_exports (deploy_data);
+      if (exports[0] != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 gboolean
 xdg_app_builtin_uninstall_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -198,6 +226,7 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
   gs_free char *ref = NULL;
   gs_free char *repository = NULL;
   gs_strfreev char **deployed = NULL;
+  gboolean has_exports;
   int i;
   GError *temp_error = NULL;
 
@@ -254,6 +283,8 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
   if (!xdg_app_dir_list_deployed (dir, ref, &deployed, cancellable, error))
     goto out;
 
+  has_exports = deployments_have_exports (dir, ref, deployed, cancellable);
+
   for (i = 0; deployed[i] != NULL; i++)
     {
       g_debug ("undeploying %s", deployed[i]);
@@ -261,6 +292,10 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
         goto out;
     }
 
+  if (has_exports &&
+      !xdg_app_dir_update_exports (dir, cancellable, error))
+    goto out;
+
   g_debug ("removing deploy base");
   if (!gs_shutil_rm_rf (deploy_base, cancellable, error))
     goto out;
@@ -13,14 +13,214 @@
 static char *opt_arch;
 static char *opt_commit;
 static gboolean opt_force_remove;
+static gboolean opt_all;
+static gboolean opt_dry_run;
+static gboolean opt_no_sync;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to update for", "ARCH" },
   { "commit", 0, 0, G_OPTION_ARG_STRING, &opt_commit, "Commit to deploy", "COMMIT" },
   { "force-remove", 0, 0, G_OPTION_ARG_NONE, &opt_force_remove, "Remove old files even if running", NULL },
+  { "all", 0, 0, G_OPTION_ARG_NONE, &opt_all, "Update everything that is installed", NULL },
+  { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, "Only show what would be updated, and how much would be downloaded", NULL },
+  { "no-sync", 0, 0, G_OPTION_ARG_NONE, &opt_no_sync, "Don't sync anything to disk, unsafe if the system crashes", NULL },
   { NULL }
 };
 
+/* Deploys the newest pulled commit (or --commit) of ref, and
+   undeploys the earlier deployments that are not kept. A commit that
+   is still deployed, e.g. after a rollback, is made active again. */
+static gboolean
+deploy_update (XdgAppDir    *dir,
+               const char   *ref,
+               gboolean     *out_undeployed,
+               GCancellable *cancellable,
+               GError      **error)
+{
+  gboolean ret = FALSE;
+  GError *my_error = NULL;
+
+  if (!xdg_app_dir_deploy (dir, ref, opt_commit, cancellable, &my_error))
+    {
+      gs_free char *checksum = NULL;
+
+      if (!g_error_matches (my_error, XDG_APP_DIR_ERROR, XDG_APP_DIR_ERROR_ALREADY_DEPLOYED))
+        {
+          g_propagate_error (error, my_error);
+          goto out;
+        }
+      g_error_free (my_error);
+
+      if (opt_commit)
+        checksum = g_strdup (opt_commit);
+      else if (!ostree_repo_resolve_rev (xdg_app_dir_get_repo (dir), ref, FALSE,
+                                         &checksum, error))
+        goto out;
+
+      if (!xdg_app_dir_set_active (dir, ref, checksum, cancellable, error))
+        goto out;
+    }
+
+  if (!xdg_app_dir_undeploy_old (dir, ref, opt_force_remove, out_undeployed,
+                                 cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Updates the given refs, which all come from the same remote. The
+   summary of the remote is fetched once and compared with the active
+   deployments, and only the outdated refs are pulled and deployed. */
+static gboolean
+update_refs_from_origin (XdgAppDir    *dir,
+                         const char   *repository,
+                         GPtrArray    *refs,
+                         gboolean     *out_undeployed,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *url = NULL;
+  gs_unref_object GFile *cache_dir = NULL;
+  XdgAppSummary *summary = NULL;
+  gs_unref_ptrarray GPtrArray *outdated = NULL;
+  int i;
+
+  if (!ostree_repo_remote_get_url (xdg_app_dir_get_repo (dir), repository, &url, error))
+    goto out;
+
+  cache_dir = xdg_app_dir_get_summary_cache_dir (dir);
+  summary = xdg_app_summary_load (url, cache_dir, cancellable, error);
+  if (summary == NULL)
+    goto out;
+
+  outdated = g_ptr_array_new ();
+
+  for (i = 0; i < refs->len; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      const guint8 *remote_csum;
+      char remote_checksum[65];
+      gs_free char *active = NULL;
+
+      if (!xdg_app_summary_lookup_ref (summary, ref, &remote_csum))
+        {
+          g_printerr ("%s not found in remote %s, skipping\n", ref, repository);
+          continue;
+        }
+
+      ostree_checksum_inplace_from_bytes (remote_csum, remote_checksum);
+      active = xdg_app_dir_read_active (dir, ref, cancellable);
+      if (g_strcmp0 (active, remote_checksum) == 0)
+        {
+          g_debug ("%s is up to date", ref);
+          continue;
+        }
+
+      g_ptr_array_add (outdated, (char *)ref);
+    }
+
+  if (outdated->len == 0)
+    {
+      if (opt_dry_run)
+        g_print ("Nothing to update from %s\n", repository);
+      ret = TRUE;
+      goto out;
+    }
+
+  g_ptr_array_add (outdated, NULL);
+
+  if (opt_dry_run)
+    {
+      ret = xdg_app_dir_estimate_pull (dir, repository, (const char **)outdated->pdata,
+                                       summary, cancellable, error);
+      goto out;
+    }
+
+  if (!xdg_app_dir_pull_updates (dir, repository, (const char **)outdated->pdata,
+                                 summary, cancellable, error))
+    goto out;
+
+  for (i = 0; g_ptr_array_index (outdated, i) != NULL; i++)
+    {
+      const char *ref = g_ptr_array_index (outdated, i);
+
+      g_print ("Updating %s\n", ref);
+      if (!deploy_update (dir, ref, out_undeployed, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  xdg_app_summary_free (summary);
+  return ret;
+}
+
+static gboolean
+update_all (XdgAppDir    *dir,
+            const char   *kind,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *refs_by_origin = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean undeployed = FALSE;
+  GError *first_error = NULL;
+
+  if (!xdg_app_dir_list_refs_by_origin (dir, kind, &refs_by_origin, cancellable, error))
+    goto out;
+
+  /* A remote that can't be reached doesn't keep the others from being
+     updated, its error is returned once everything else is done */
+  g_hash_table_iter_init (&iter, refs_by_origin);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GError *temp_error = NULL;
+
+      if (!update_refs_from_origin (dir, key, value, &undeployed, cancellable, &temp_error))
+        {
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+
+          g_printerr ("Failed to update from remote %s: %s\n", (char *)key, temp_error->message);
+          if (first_error == NULL)
+            first_error = temp_error;
+          else
+            g_error_free (temp_error);
+        }
+    }
+
+  if (!opt_dry_run)
+    {
+      if (undeployed && !xdg_app_dir_prune (dir, cancellable, error))
+        goto out;
+
+      if (strcmp (kind, "app") == 0 &&
+          !xdg_app_dir_update_exports (dir, cancellable, error))
+        goto out;
+    }
+
+  if (first_error)
+    {
+      g_propagate_error (error, first_error);
+      first_error = NULL;
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (first_error)
+    g_error_free (first_error);
+  return ret;
+}
+
 gboolean
 xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -28,19 +228,36 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
   GOptionContext *context;
   gs_unref_object XdgAppDir *dir = NULL;
   gs_unref_object GFile *deploy_base = NULL;
-  gs_unref_object GFile *origin = NULL;
   const char *runtime;
   const char *branch = "master";
-  gs_free char *previous_deployment = NULL;
   gs_free char *ref = NULL;
   gs_free char *repository = NULL;
-  GError *my_error;
+  const char *refs[2];
+  gboolean undeployed = FALSE;
 
   context = g_option_context_new ("RUNTIME [BRANCH] - Update a runtime");
 
   if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
     goto out;
 
+  if (opt_no_sync)
+    xdg_app_dir_set_no_sync (dir, TRUE);
+
+  if (opt_all)
+    {
+      if (argc > 1 || opt_commit)
+        {
+          usage_error (context, "RUNTIME and --commit can't be used with --all", error);
+          goto out;
+        }
+
+      if (!update_all (dir, "runtime", cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
   if (argc < 2)
     {
       usage_error (context, "RUNTIME must be specified", error);
@@ -72,38 +289,30 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
       goto out;
     }
 
-  origin = g_file_get_child (deploy_base, "origin");
-  if (!g_file_load_contents (origin, cancellable, &repository, NULL, NULL, error))
-    goto out;
-
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (!xdg_app_dir_read_origin (dir, ref, &repository, cancellable, error))
     goto out;
 
-  previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
-
-  my_error = NULL;
-  if (!xdg_app_dir_deploy (dir, ref, opt_commit, cancellable, &my_error))
+  if (opt_dry_run)
     {
-      if (g_error_matches (my_error, XDG_APP_DIR_ERROR, XDG_APP_DIR_ERROR_ALREADY_DEPLOYED))
-        g_error_free (my_error);
-      else
-        {
-          g_propagate_error (error, my_error);
-          goto out;
-        }
+      gs_unref_ptrarray GPtrArray *dry_run_refs = g_ptr_array_new ();
+
+      g_ptr_array_add (dry_run_refs, ref);
+      ret = update_refs_from_origin (dir, repository, dry_run_refs, &undeployed,
+                                     cancellable, error);
+      goto out;
     }
 
-  if (previous_deployment != NULL)
-    {
-      if (!xdg_app_dir_undeploy (dir, ref, previous_deployment,
-				 opt_force_remove,
+  refs[0] = ref;
+  refs[1] = NULL;
+  if (!xdg_app_dir_pull_updates (dir, repository, refs, NULL,
                                  cancellable, error))
-        goto out;
+    goto out;
 
-      if (!xdg_app_dir_prune (dir, cancellable, error))
-        goto out;
-    }
+  if (!deploy_update (dir, ref, &undeployed, cancellable, error))
+    goto out;
+
+  if (undeployed && !xdg_app_dir_prune (dir, cancellable, error))
+    goto out;
 
   ret = TRUE;
  out:
@@ -119,19 +328,36 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
   GOptionContext *context;
   gs_unref_object XdgAppDir *dir = NULL;
   gs_unref_object GFile *deploy_base = NULL;
-  gs_unref_object GFile *origin = NULL;
   const char *app;
   const char *branch = "master";
   gs_free char *ref = NULL;
   gs_free char *repository = NULL;
-  gs_free char *previous_deployment = NULL;
-  GError *my_error;
+  const char *refs[2];
+  gboolean undeployed = FALSE;
 
   context = g_option_context_new ("APP [BRANCH] - Update an application");
 
   if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
     goto out;
 
+  if (opt_no_sync)
+    xdg_app_dir_set_no_sync (dir, TRUE);
+
+  if (opt_all)
+    {
+      if (argc > 1 || opt_commit)
+        {
+          usage_error (context, "APP and --commit can't be used with --all", error);
+          goto out;
+        }
+
+      if (!update_all (dir, "app", cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
   if (argc < 2)
     {
       usage_error (context, "APP must be specified", error);
@@ -163,38 +389,33 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
       goto out;
     }
 
-  origin = g_file_get_child (deploy_base, "origin");
-  if (!g_file_load_contents (origin, cancellable, &repository, NULL, NULL, error))
-    goto out;
-
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (!xdg_app_dir_read_origin (dir, ref, &repository, cancellable, error))
     goto out;
 
-  previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
-
-  my_error = NULL;
-  if (!xdg_app_dir_deploy (dir, ref, opt_commit, cancellable, &my_error))
+  if (opt_dry_run)
     {
-      if (g_error_matches (my_error, XDG_APP_DIR_ERROR, XDG_APP_DIR_ERROR_ALREADY_DEPLOYED))
-        g_error_free (my_error);
-      else
-        {
-          g_propagate_error (error, my_error);
-          goto out;
-        }
+      gs_unref_ptrarray GPtrArray *dry_run_refs = g_ptr_array_new ();
+
+      g_ptr_array_add (dry_run_refs, ref);
+      ret = update_refs_from_origin (dir, repository, dry_run_refs, &undeployed,
+                                     cancellable, error);
+      goto out;
     }
 
-  if (previous_deployment != NULL)
-    {
-      if (!xdg_app_dir_undeploy (dir, ref, previous_deployment,
-				 opt_force_remove,
+  refs[0] = ref;
+  refs[1] = NULL;
+  if (!xdg_app_dir_pull_updates (dir, repository, refs, NULL,
                                  cancellable, error))
-        goto out;
+    goto out;
 
-      if (!xdg_app_dir_prune (dir, cancellable, error))
-        goto out;
-    }
+  if (!deploy_update (dir, ref, &undeployed, cancellable, error))
+    goto out;
+
+  if (undeployed && !xdg_app_dir_prune (dir, cancellable, error))
+    goto out;
+
+  if (!xdg_app_dir_update_exports (dir, cancellable, error))
+    goto out;
 
   ret = TRUE;
  out:
@@ -46,6 +46,8 @@ BUILTINPROTO(build);
 BUILTINPROTO(build_finish);
 BUILTINPROTO(build_export);
 BUILTINPROTO(repo_update);
+BUILTINPROTO(repair);
+BUILTINPROTO(rollback);
 
 #undef BUILTINPROTO
 
@@ -1,10 +1,19 @@
+#define _GNU_SOURCE /* Required for syncfs */
 #include "config.h"
 
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include "libgsystem.h"
 
 #include "xdg-app-dir.h"
@@ -18,6 +27,8 @@ struct XdgAppDir {
   gboolean user;
   GFile *basedir;
   OstreeRepo *repo;
+  OstreeRepoDevInoCache *devino_cache;
+  gboolean no_sync;
 };
 
 typedef struct {
@@ -35,6 +46,10 @@ enum {
   PROP_PATH
 };
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 #define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
                                    "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
 
@@ -58,6 +73,7 @@ xdg_app_dir_finalize (GObject *object)
 
   g_clear_object (&self->repo);
   g_clear_object (&self->basedir);
+  g_clear_pointer (&self->devino_cache, ostree_repo_devino_cache_unref);
 
   G_OBJECT_CLASS (xdg_app_dir_parent_class)->finalize (object);
 }
@@ -168,6 +184,20 @@ xdg_app_dir_get_removed_dir (XdgAppDir     *self)
   return g_file_get_child (self->basedir, ".removed");
 }
 
+/* Holds the exported desktop and service files rewritten for
+   deployments, hardlinked from their export directories */
+static GFile *
+xdg_app_dir_get_export_cache_dir (XdgAppDir     *self)
+{
+  return g_file_get_child (self->basedir, ".export-cache");
+}
+
+GFile *
+xdg_app_dir_get_summary_cache_dir (XdgAppDir     *self)
+{
+  return g_file_get_child (self->basedir, "summaries");
+}
+
 GFile *
 xdg_app_dir_get_app_data (XdgAppDir     *self,
                           const char    *app)
@@ -184,6 +214,17 @@ xdg_app_dir_get_repo (XdgAppDir *self)
   return self->repo;
 }
 
+/* Don't sync anything to disk, neither pulled objects nor deployments.
+   Only meant for installations that are thrown away after a crash. */
+void
+xdg_app_dir_set_no_sync (XdgAppDir *self,
+                         gboolean   no_sync)
+{
+  self->no_sync = no_sync;
+  if (self->repo)
+    ostree_repo_set_disable_fsync (self->repo, no_sync);
+}
+
 gboolean
 xdg_app_dir_ensure_path (XdgAppDir     *self,
                          GCancellable  *cancellable,
@@ -231,6 +272,9 @@ xdg_app_dir_ensure_repo (XdgAppDir *self,
             }
         }
 
+      if (self->no_sync)
+        ostree_repo_set_disable_fsync (repo, TRUE);
+
       self->repo = g_object_ref (repo);
     }
 
@@ -239,552 +283,4552 @@ xdg_app_dir_ensure_repo (XdgAppDir *self,
   return ret;
 }
 
-gboolean
-xdg_app_dir_pull (XdgAppDir *self,
-                  const char *repository,
-                  const char *ref,
-                  GCancellable *cancellable,
-                  GError **error)
+/* The part of a ref that is pulled and deployed, as recorded in the
+   subset file next to the origin. subpaths are directories of the
+   commit, and languages the translations in files/share/locale to
+   keep, either NULL for all of them. */
+typedef struct {
+  char **subpaths;
+  char **languages;
+} DeploySubset;
+
+typedef enum {
+  SUBSET_MATCH_NONE,
+  SUBSET_MATCH_PARTIAL,
+  SUBSET_MATCH_ALL,
+} SubsetMatch;
+
+#define SUBSET_LOCALE_DIR "/files/share/locale"
+
+static void
+deploy_subset_free (DeploySubset *subset)
+{
+  if (subset == NULL)
+    return;
+
+  g_strfreev (subset->subpaths);
+  g_strfreev (subset->languages);
+  g_free (subset);
+}
+
+/* Loads the subset of ref, or NULL if all of it is deployed */
+static gboolean
+load_deploy_subset (XdgAppDir *self,
+                    const char *ref,
+                    DeploySubset **out_subset,
+                    GError **error)
 {
   gboolean ret = FALSE;
-  GSConsole *console = NULL;
-  gs_unref_object OstreeAsyncProgress *progress = NULL;
-  const char *refs[2];
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *subset_file = NULL;
+  gs_unref_keyfile GKeyFile *keyfile = NULL;
+  DeploySubset *subset = NULL;
+  GError *temp_error = NULL;
 
-  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
-    goto out;
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  subset_file = g_file_get_child (deploy_base, "subset");
 
-  console = gs_console_get ();
-  if (console)
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, gs_file_get_path_cached (subset_file),
+                                  G_KEY_FILE_NONE, &temp_error))
     {
-      gs_console_begin_status_line (console, "", NULL, NULL);
-      progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, console);
+      if (!g_error_matches (temp_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
     }
-
-  refs[0] = ref;
-  refs[1] = NULL;
-  if (!ostree_repo_pull (self->repo, repository,
-                         (char **)refs, OSTREE_REPO_PULL_FLAGS_NONE,
-                         progress,
-                         cancellable, error))
+  else
     {
-      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
-      goto out;
+      subset = g_new0 (DeploySubset, 1);
+      subset->subpaths = g_key_file_get_string_list (keyfile, "Subset", "subpaths", NULL, NULL);
+      subset->languages = g_key_file_get_string_list (keyfile, "Subset", "languages", NULL, NULL);
     }
 
-  if (console)
-    gs_console_end_status_line (console, NULL, NULL);
+  *out_subset = subset;
 
   ret = TRUE;
  out:
   return ret;
 }
 
-char *
-xdg_app_dir_read_active (XdgAppDir *self,
-                         const char *ref,
-                         GCancellable *cancellable)
+/* Returns whether path is dir or below it */
+static gboolean
+path_is_below (const char *path,
+               const char *dir)
 {
-  gs_unref_object GFile *deploy_base = NULL;
-  gs_unref_object GFile *active_link = NULL;
-  gs_unref_object GFileInfo *file_info = NULL;
+  gsize len = strlen (dir);
 
-  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
-  active_link = g_file_get_child (deploy_base, "active");
+  if (strcmp (dir, "/") == 0)
+    return TRUE;
 
-  file_info = g_file_query_info (active_link, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, NULL);
-  if (file_info == NULL)
-    return NULL;
+  return strncmp (path, dir, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
 
-  return g_strdup (g_file_info_get_symlink_target (file_info));
+/* Turns subpath into an absolute path without empty, "." or trailing
+   components */
+static char *
+normalize_subpath (const char *subpath,
+                   GError **error)
+{
+  gs_strfreev char **parts = NULL;
+  GString *normalized;
+  int i;
+
+  if (subpath[0] != '/')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Subpath %s is not absolute", subpath);
+      return NULL;
+    }
+
+  normalized = g_string_new ("");
+  parts = g_strsplit (subpath, "/", -1);
+  for (i = 0; parts[i] != NULL; i++)
+    {
+      if (*parts[i] == 0 || strcmp (parts[i], ".") == 0)
+        continue;
+
+      if (strcmp (parts[i], "..") == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid subpath %s", subpath);
+          g_string_free (normalized, TRUE);
+          return NULL;
+        }
+
+      g_string_append_c (normalized, '/');
+      g_string_append (normalized, parts[i]);
+    }
+
+  if (normalized->len == 0)
+    g_string_append_c (normalized, '/');
+
+  return g_string_free (normalized, FALSE);
 }
 
+/* Records the subset of ref to pull and deploy from now on. subpaths
+   are directories of the commit, like /files/lib, and languages are
+   the translations in files/share/locale to keep, e.g. "de" for de,
+   de_AT and de_DE@euro. Either can be NULL for everything. */
 gboolean
-xdg_app_dir_set_active (XdgAppDir *self,
+xdg_app_dir_set_subset (XdgAppDir *self,
                         const char *ref,
-                        const char *checksum,
+                        const char **subpaths,
+                        const char **languages,
                         GCancellable *cancellable,
                         GError **error)
 {
   gboolean ret = FALSE;
   gs_unref_object GFile *deploy_base = NULL;
-  gs_free char *tmpname = NULL;
-  gs_unref_object GFile *active_tmp_link = NULL;
-  gs_unref_object GFile *active_link = NULL;
-  gs_free_error GError *my_error = NULL;
+  gs_unref_object GFile *subset_file = NULL;
+  gs_unref_keyfile GKeyFile *keyfile = NULL;
+  gs_unref_ptrarray GPtrArray *normalized = NULL;
+  gs_free char *data = NULL;
+  gsize length;
+  int i, j;
 
   deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
-  active_link = g_file_get_child (deploy_base, "active");
+  subset_file = g_file_get_child (deploy_base, "subset");
 
-  if (checksum != NULL)
+  if (subpaths != NULL)
     {
-      tmpname = gs_fileutil_gen_tmp_name (".active-", NULL);
-      active_tmp_link = g_file_get_child (deploy_base, tmpname);
-      if (!g_file_make_symbolic_link (active_tmp_link, checksum, cancellable, error))
-        goto out;
+      normalized = g_ptr_array_new_with_free_func (g_free);
+      for (i = 0; subpaths[i] != NULL; i++)
+        {
+          char *subpath = normalize_subpath (subpaths[i], error);
 
-      if (!gs_file_rename (active_tmp_link,
-                           active_link,
-                           cancellable, error))
-        goto out;
+          if (subpath == NULL)
+            goto out;
+
+          g_ptr_array_add (normalized, subpath);
+        }
+
+      /* Subpaths below others are pulled with them already */
+      for (i = normalized->len - 1; i >= 0; i--)
+        {
+          for (j = 0; j < normalized->len; j++)
+            {
+              if (i != j &&
+                  path_is_below (g_ptr_array_index (normalized, i),
+                                 g_ptr_array_index (normalized, j)) &&
+                  (strcmp (g_ptr_array_index (normalized, i),
+                           g_ptr_array_index (normalized, j)) != 0 || j < i))
+                {
+                  g_ptr_array_remove_index (normalized, i);
+                  break;
+                }
+            }
+        }
+
+      if (normalized->len == 1 &&
+          strcmp (g_ptr_array_index (normalized, 0), "/") == 0)
+        g_clear_pointer (&normalized, g_ptr_array_unref);
     }
-  else
+
+  if (normalized == NULL && languages == NULL)
     {
-      if (!g_file_delete (active_link, cancellable, &my_error) &&
-          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      if (unlink (gs_file_get_path_cached (subset_file)) != 0 && errno != ENOENT)
         {
-          g_propagate_error (error, my_error);
-          my_error = NULL;
+          gs_set_error_from_errno (error, errno);
           goto out;
         }
+
+      ret = TRUE;
+      goto out;
     }
 
+  keyfile = g_key_file_new ();
+  if (normalized != NULL)
+    g_key_file_set_string_list (keyfile, "Subset", "subpaths",
+                                (const char * const *)normalized->pdata, normalized->len);
+  if (languages != NULL)
+    g_key_file_set_string_list (keyfile, "Subset", "languages",
+                                languages, g_strv_length ((char **)languages));
+
+  data = g_key_file_to_data (keyfile, &length, NULL);
+  if (!g_file_replace_contents (subset_file, data, length, NULL, FALSE,
+                                G_FILE_CREATE_NONE, NULL, cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
   return ret;
 }
 
+static gboolean
+language_matches (const char *name,
+                  char **languages)
+{
+  gsize len = strcspn (name, "_.@");
+  int i;
 
-gboolean
-xdg_app_dir_run_triggers (XdgAppDir *self,
-			  GCancellable *cancellable,
-			  GError **error)
+  for (i = 0; languages[i] != NULL; i++)
+    {
+      if (strcmp (languages[i], name) == 0 ||
+          (strlen (languages[i]) == len && strncmp (languages[i], name, len) == 0))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Returns whether the file of a commit described by info is in subset.
+   Of partially matching directories, only the children that match
+   themselves are. The metadata file is always deployed, but can't be
+   pulled with subdirectory pulls, so only if it is in the repo. */
+static SubsetMatch
+deploy_subset_match (DeploySubset *subset,
+                     OstreeRepo *repo,
+                     GFile *file,
+                     GFileInfo *info)
 {
-  gboolean ret = FALSE;
-  gs_unref_object GFileEnumerator *dir_enum = NULL;
-  gs_unref_object GFileInfo *child_info = NULL;
-  gs_unref_object GFile *triggersdir = NULL;
-  gs_unref_object GFile *exports = NULL;
-  GError *temp_error = NULL;
+  gs_free char *path = NULL;
+  gboolean is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+  gboolean included = FALSE;
+  gboolean above = FALSE;
+  int i;
 
-  g_debug ("running triggers");
+  if (subset == NULL)
+    return SUBSET_MATCH_ALL;
 
-  exports = xdg_app_dir_get_exports_dir (self);
+  path = g_file_get_path (file);
 
-  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+  if (strcmp (path, "/metadata") == 0)
+    {
+      gboolean have_object = FALSE;
 
-  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
-                                        0, cancellable, error);
-  if (!dir_enum)
-    goto out;
+      ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE,
+                              ostree_repo_file_get_checksum (OSTREE_REPO_FILE (file)),
+                              &have_object, NULL, NULL);
+      return have_object ? SUBSET_MATCH_ALL : SUBSET_MATCH_NONE;
+    }
 
-  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  if (subset->languages != NULL && is_dir)
     {
-      gs_unref_object GFile *child = NULL;
-      const char *name;
-      GError *trigger_error = NULL;
+      gs_free char *parent = g_path_get_dirname (path);
 
-      name = g_file_info_get_name (child_info);
+      if (strcmp (parent, SUBSET_LOCALE_DIR) == 0 &&
+          !language_matches (g_file_info_get_name (info), subset->languages))
+        return SUBSET_MATCH_NONE;
+    }
 
-      child = g_file_get_child (triggersdir, name);
+  if (subset->subpaths == NULL)
+    included = TRUE;
+  else
+    {
+      for (i = 0; subset->subpaths[i] != NULL; i++)
+        {
+          if (path_is_below (path, subset->subpaths[i]))
+            included = TRUE;
+          else if (is_dir && path_is_below (subset->subpaths[i], path))
+            above = TRUE;
+        }
+    }
 
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
-	  g_str_has_suffix (name, ".trigger"))
-	{
-	  gs_unref_ptrarray GPtrArray *argv_array = NULL;
+  if (included && is_dir && subset->languages != NULL &&
+      path_is_below (SUBSET_LOCALE_DIR, path))
+    return SUBSET_MATCH_PARTIAL;
 
-	  g_debug ("running trigger %s", name);
+  if (included)
+    return SUBSET_MATCH_ALL;
 
-	  argv_array = g_ptr_array_new_with_free_func (g_free);
-	  g_ptr_array_add (argv_array, g_strdup (HELPER));
-	  g_ptr_array_add (argv_array, g_strdup ("-a"));
-	  g_ptr_array_add (argv_array, g_file_get_path (self->basedir));
-	  g_ptr_array_add (argv_array, g_strdup ("-e"));
-	  g_ptr_array_add (argv_array, g_strdup ("-F"));
-	  g_ptr_array_add (argv_array, g_strdup ("/usr"));
-	  g_ptr_array_add (argv_array, g_file_get_path (child));
-	  g_ptr_array_add (argv_array, NULL);
+  if (above)
+    return SUBSET_MATCH_PARTIAL;
 
-	  if (!g_spawn_sync ("/",
-			     (char **)argv_array->pdata,
-			     NULL,
-			     G_SPAWN_DEFAULT,
-			     NULL, NULL,
-			     NULL, NULL,
-			     NULL, &trigger_error))
-	    {
-	      g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-	      g_clear_error (&trigger_error);
-	    }
-	}
+  return SUBSET_MATCH_NONE;
+}
 
-      g_clear_object (&child_info);
-    }
+/* Returns the repository of @repository if it is on the local
+   filesystem and its objects can be imported directly, or NULL */
+static OstreeRepo *
+open_local_remote (XdgAppDir *self,
+                   const char *repository,
+                   GCancellable *cancellable)
+{
+  gs_free char *url = NULL;
+  gs_free char *group = NULL;
+  gs_unref_object GFile *path = NULL;
+  gs_unref_object OstreeRepo *src = NULL;
+  GKeyFile *config;
+  gboolean gpg_verify;
+  GError *temp_error = NULL;
+
+  if (!ostree_repo_remote_get_url (self->repo, repository, &url, NULL) ||
+      !g_str_has_prefix (url, "file://"))
+    return NULL;
 
+  /* Importing skips signature checks, so only do it for remotes that
+     don't want them */
+  config = ostree_repo_get_config (self->repo);
+  group = g_strdup_printf ("remote \"%s\"", repository);
+  gpg_verify = g_key_file_get_boolean (config, group, "gpg-verify", &temp_error);
   if (temp_error != NULL)
     {
-      g_propagate_error (error, temp_error);
-      goto out;
+      gpg_verify = TRUE;
+      g_clear_error (&temp_error);
     }
+  if (gpg_verify)
+    return NULL;
 
-  ret = TRUE;
- out:
-  return ret;
+  path = g_file_new_for_uri (url);
+  src = ostree_repo_new (path);
+  if (!ostree_repo_open (src, cancellable, &temp_error))
+    {
+      g_debug ("Can't open %s, pulling instead: %s", url, temp_error->message);
+      g_clear_error (&temp_error);
+      return NULL;
+    }
+
+  return g_object_ref (src);
 }
 
 static gboolean
-read_fd (int           fd,
-         struct stat  *stat_buf,
-         gchar       **contents,
-         gsize        *length,
-         GError      **error)
+copy_xattrs (int src_fd,
+             int dest_fd,
+             GError **error)
 {
-  gchar *buf;
-  gsize bytes_read;
-  gsize size;
-  gsize alloc_size;
-
-  size = stat_buf->st_size;
+  gboolean ret = FALSE;
+  gs_free char *names = NULL;
+  ssize_t len;
+  char *name;
 
-  alloc_size = size + 1;
-  buf = g_try_malloc (alloc_size);
+  len = flistxattr (src_fd, NULL, 0);
+  if (len < 0)
+    {
+      /* Nothing to copy if the filesystem has no xattrs */
+      if (errno == ENOTSUP)
+        return TRUE;
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
 
-  if (buf == NULL)
+  names = g_malloc (len);
+  len = flistxattr (src_fd, names, len);
+  if (len < 0)
     {
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   G_FILE_ERROR_NOMEM,
-                   "not enough memory");
-      return FALSE;
+      gs_set_error_from_errno (error, errno);
+      goto out;
     }
 
-  bytes_read = 0;
-  while (bytes_read < size)
+  for (name = names; name < names + len; name += strlen (name) + 1)
     {
-      gssize rc;
+      gs_free char *value = NULL;
+      ssize_t value_len;
 
-      rc = read (fd, buf + bytes_read, size - bytes_read);
+      value_len = fgetxattr (src_fd, name, NULL, 0);
+      if (value_len < 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
 
-      if (rc < 0)
+      value = g_malloc (value_len);
+      value_len = fgetxattr (src_fd, name, value, value_len);
+      if (value_len < 0 ||
+          fsetxattr (dest_fd, name, value, value_len, 0) != 0)
         {
-          if (errno != EINTR)
-            {
-              int save_errno = errno;
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
 
-              g_free (buf);
-              g_set_error (error,
-                           G_FILE_ERROR,
-                           g_file_error_from_errno (save_errno),
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Shares the data of the loose object at src_path with a new file at
+   dest_path, keeping its mode, owner and xattrs, which is what the
+   bare modes store the file metadata in. */
+static gboolean
+reflink_object (const char *src_path,
+                const char *dest_path,
+                GError **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmp_path = NULL;
+  int src_fd = -1;
+  int dest_fd = -1;
+  struct stat stbuf;
+
+  src_fd = open (src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (src_fd == -1 || fstat (src_fd, &stbuf) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  tmp_path = g_strconcat (dest_path, ".tmp", NULL);
+  dest_fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (dest_fd == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Can't reflink %s: %s", src_path, g_strerror (errsv));
+      goto out;
+    }
+
+  if ((getuid () == 0 && fchown (dest_fd, stbuf.st_uid, stbuf.st_gid) != 0) ||
+      fchmod (dest_fd, stbuf.st_mode & 07777) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!copy_xattrs (src_fd, dest_fd, error))
+    goto out;
+
+  if (rename (tmp_path, dest_path) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (!ret && tmp_path != NULL)
+    (void) unlink (tmp_path);
+  if (src_fd != -1)
+    close (src_fd);
+  if (dest_fd != -1)
+    close (dest_fd);
+  return ret;
+}
+
+/* Hardlinks or reflinks a loose object from src into dest. Sets
+   @out_done to FALSE if neither works, e.g. across filesystems. */
+static gboolean
+link_object (OstreeRepo *src,
+             OstreeRepo *dest,
+             OstreeObjectType objtype,
+             const char *checksum,
+             gboolean *out_done,
+             GError **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *relpath = NULL;
+  gs_free char *src_path = NULL;
+  gs_free char *dest_path = NULL;
+  gs_free char *dest_dir = NULL;
+  struct stat stbuf;
+  GError *temp_error = NULL;
+
+  *out_done = FALSE;
+
+  relpath = ostree_get_relative_object_path (checksum, objtype,
+                                             ostree_repo_get_mode (src) == OSTREE_REPO_MODE_ARCHIVE_Z2);
+  src_path = g_build_filename (gs_file_get_path_cached (ostree_repo_get_path (src)), relpath, NULL);
+  dest_path = g_build_filename (gs_file_get_path_cached (ostree_repo_get_path (dest)), relpath, NULL);
+
+  dest_dir = g_path_get_dirname (dest_path);
+  if (mkdir (dest_dir, 0777) != 0 && errno != EEXIST)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (lstat (src_path, &stbuf) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  /* A hardlink shares the file with whoever owns it, so root must not
+     link files that a user could modify later */
+  if (stbuf.st_uid == geteuid () || stbuf.st_uid == 0)
+    {
+      if (link (src_path, dest_path) == 0 || errno == EEXIST)
+        {
+          *out_done = TRUE;
+          ret = TRUE;
+          goto out;
+        }
+
+      /* E.g. protected_hardlinks or different filesystems */
+      if (errno != EXDEV && errno != EPERM && errno != EMLINK)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  /* Symlink objects of bare repos can't be cloned, opening them would
+     clone their target instead. ostree copies them. */
+  if (!S_ISREG (stbuf.st_mode))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  /* If this fails too, ostree still can copy it */
+  if (!reflink_object (src_path, dest_path, &temp_error))
+    {
+      g_debug ("%s", temp_error->message);
+      g_error_free (temp_error);
+    }
+  else
+    *out_done = TRUE;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *src;
+  OstreeRepo *dest;
+  gboolean same_mode;
+  GMutex lock;
+  GError *error;
+  GCancellable *cancellable;
+} ImportContext;
+
+static gboolean
+import_object (ImportContext *context,
+               OstreeObjectType objtype,
+               const char *checksum,
+               GError **error)
+{
+  gboolean done = FALSE;
+
+  /* Metadata objects are stored the same way in all modes, content
+     objects only in the same mode */
+  if ((context->same_mode || objtype != OSTREE_OBJECT_TYPE_FILE) &&
+      !link_object (context->src, context->dest, objtype, checksum, &done, error))
+    return FALSE;
+
+  /* Otherwise ostree copies it, and decompresses it if the source is an
+     archive */
+  if (!done &&
+      !ostree_repo_import_object_from (context->dest, context->src, objtype, checksum,
+                                       context->cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+import_object_thread (gpointer data,
+                      gpointer user_data)
+{
+  GVariant *object = data;
+  ImportContext *context = user_data;
+  const char *checksum;
+  OstreeObjectType objtype;
+  GError *temp_error = NULL;
+
+  ostree_object_name_deserialize (object, &checksum, &objtype);
+
+  if (!g_cancellable_is_cancelled (context->cancellable) &&
+      !import_object (context, objtype, checksum, &temp_error))
+    {
+      g_mutex_lock (&context->lock);
+      if (context->error == NULL)
+        {
+          g_prefix_error (&temp_error, "Importing %s: ", checksum);
+          context->error = temp_error;
+          temp_error = NULL;
+          g_cancellable_cancel (context->cancellable);
+        }
+      g_mutex_unlock (&context->lock);
+      g_clear_error (&temp_error);
+    }
+
+  g_variant_unref (object);
+}
+
+/* Imports refs from the local repository src, instead of going through
+   the generic pull code that reads and rewrites every object. Objects
+   are hardlinked or reflinked where possible, and otherwise imported by
+   ostree, in parallel. Like a pull, only the commits the refs point
+   to are imported, not their history. The commits are imported last,
+   so that an interrupted import never leaves a commit with missing
+   objects. */
+static gboolean
+import_local_refs (XdgAppDir *self,
+                   OstreeRepo *src,
+                   const char *repository,
+                   const char **refs,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *reachable = NULL;
+  gs_unref_ptrarray GPtrArray *revs = NULL;
+  gs_unref_ptrarray GPtrArray *commits = NULL;
+  gs_unref_object GCancellable *import_cancellable = NULL;
+  GThreadPool *pool = NULL;
+  ImportContext context = { NULL };
+  GHashTableIter iter;
+  gpointer key;
+  guint n_objects = 0;
+  int i;
+
+  reachable = ostree_repo_traverse_new_reachable ();
+  revs = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      char *rev = NULL;
+
+      if (!ostree_repo_resolve_rev (src, refs[i], FALSE, &rev, error) ||
+          !ostree_repo_traverse_commit (src, rev, 0, reachable, cancellable, error))
+        {
+          g_free (rev);
+          g_prefix_error (error, "While importing %s from remote %s: ", refs[i], repository);
+          goto out;
+        }
+
+      g_ptr_array_add (revs, rev);
+    }
+
+  if (!ostree_repo_prepare_transaction (self->repo, NULL, cancellable, error))
+    goto out;
+
+  import_cancellable = g_cancellable_new ();
+  context.src = src;
+  context.dest = self->repo;
+  context.same_mode = ostree_repo_get_mode (src) == ostree_repo_get_mode (self->repo);
+  context.cancellable = import_cancellable;
+  g_mutex_init (&context.lock);
+
+  pool = g_thread_pool_new (import_object_thread, &context, g_get_num_processors (), FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  commits = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      GVariant *object = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean have_object;
+
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (!ostree_repo_has_object (self->repo, objtype, checksum, &have_object, cancellable, error))
+        goto out;
+
+      if (have_object)
+        continue;
+
+      n_objects++;
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        g_ptr_array_add (commits, g_variant_ref (object));
+      else
+        g_thread_pool_push (pool, g_variant_ref (object), NULL);
+    }
+
+  g_print ("Importing %u objects from %s\n", n_objects, repository);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  pool = NULL;
+
+  if (context.error)
+    {
+      g_propagate_error (error, context.error);
+      context.error = NULL;
+      goto out;
+    }
+
+  for (i = 0; i < commits->len; i++)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (g_ptr_array_index (commits, i), &checksum, &objtype);
+      if (!import_object (&context, objtype, checksum, error))
+        goto out;
+    }
+
+  /* Commits pulled by checksum don't get a ref */
+  for (i = 0; refs[i] != NULL; i++)
+    if (!ostree_validate_checksum_string (refs[i], NULL))
+      ostree_repo_transaction_set_ref (self->repo, repository, refs[i], g_ptr_array_index (revs, i));
+
+  if (!ostree_repo_commit_transaction (self->repo, NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (pool)
+    {
+      g_cancellable_cancel (import_cancellable);
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+  if (import_cancellable)
+    g_mutex_clear (&context.lock);
+  g_clear_error (&context.error);
+  if (!ret)
+    ostree_repo_abort_transaction (self->repo, cancellable, NULL);
+  return ret;
+}
+
+/* Pulls refs, or only the directory subdir of them if that is not
+   NULL */
+static gboolean
+pull_refs (XdgAppDir *self,
+           const char *repository,
+           const char **refs,
+           const char *subdir,
+           gboolean disable_static_deltas,
+           GCancellable *cancellable,
+           GError **error)
+{
+  gboolean ret = FALSE;
+  GSConsole *console = NULL;
+  gs_unref_object OstreeAsyncProgress *progress = NULL;
+  GVariantBuilder builder;
+  gs_unref_variant GVariant *options = NULL;
+  gs_unref_object OstreeRepo *src = NULL;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  /* The local import always takes whole commits */
+  if (subdir == NULL)
+    src = open_local_remote (self, repository, cancellable);
+  if (src != NULL)
+    {
+      ret = import_local_refs (self, src, repository, refs, cancellable, error);
+      goto out;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv ((const char * const *)refs, -1)));
+  g_variant_builder_add (&builder, "{s@v}", "flags",
+                         g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_NONE)));
+  g_variant_builder_add (&builder, "{s@v}", "disable-static-deltas",
+                         g_variant_new_variant (g_variant_new_boolean (disable_static_deltas)));
+  if (subdir != NULL)
+    g_variant_builder_add (&builder, "{s@v}", "subdir",
+                           g_variant_new_variant (g_variant_new_string (subdir)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  console = gs_console_get ();
+  if (console)
+    {
+      gs_console_begin_status_line (console, "", NULL, NULL);
+      progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, console);
+    }
+
+  if (!ostree_repo_pull_with_options (self->repo, repository, options,
+                                      progress, cancellable, error))
+    {
+      gs_free char *refs_str = g_strjoinv (", ", (char **)refs);
+      if (subdir != NULL)
+        g_prefix_error (error, "While pulling %s of %s from remote %s: ", subdir, refs_str, repository);
+      else
+        g_prefix_error (error, "While pulling %s from remote %s: ", refs_str, repository);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (console)
+    gs_console_end_status_line (console, NULL, NULL);
+  return ret;
+}
+
+/* Pulls all of @refs from @repository in a single ostree pull, so that
+   the remote is only contacted once and shared objects are only
+   fetched once. */
+gboolean
+xdg_app_dir_pull_refs (XdgAppDir *self,
+                       const char *repository,
+                       const char **refs,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+  return pull_refs (self, repository, refs, NULL, FALSE, cancellable, error);
+}
+
+/* Pulls ref, or a commit, for subset. ostree pulls a single
+   subdirectory at a time, so every subpath is pulled separately, and
+   without static deltas, which always contain the whole commit. */
+static gboolean
+pull_subset (XdgAppDir *self,
+             const char *repository,
+             const char *ref,
+             DeploySubset *subset,
+             GCancellable *cancellable,
+             GError **error)
+{
+  const char *refs[2];
+  int i;
+
+  refs[0] = ref;
+  refs[1] = NULL;
+
+  if (subset == NULL || subset->subpaths == NULL)
+    return pull_refs (self, repository, refs, NULL, FALSE, cancellable, error);
+
+  for (i = 0; subset->subpaths[i] != NULL; i++)
+    {
+      if (!pull_refs (self, repository, refs, subset->subpaths[i], TRUE,
+                      cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Pulls ref, or only the subset recorded for it by
+   xdg_app_dir_set_subset() */
+gboolean
+xdg_app_dir_pull (XdgAppDir *self,
+                  const char *repository,
+                  const char *ref,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  gboolean ret = FALSE;
+  DeploySubset *subset = NULL;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  if (!load_deploy_subset (self, ref, &subset, error))
+    goto out;
+
+  if (!pull_subset (self, repository, ref, subset, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  deploy_subset_free (subset);
+  return ret;
+}
+
+/* Returns the summary of the remote, or NULL if it can't be loaded */
+static XdgAppSummary *
+load_remote_summary (XdgAppDir *self,
+                     const char *repository,
+                     GCancellable *cancellable)
+{
+  XdgAppSummary *summary = NULL;
+  gs_free char *url = NULL;
+  gs_unref_object GFile *cache_dir = NULL;
+  GError *temp_error = NULL;
+
+  cache_dir = xdg_app_dir_get_summary_cache_dir (self);
+  if (!ostree_repo_remote_get_url (self->repo, repository, &url, &temp_error) ||
+      (summary = xdg_app_summary_load (url, cache_dir, cancellable, &temp_error)) == NULL)
+    {
+      g_debug ("Can't load summary of %s: %s", repository, temp_error->message);
+      g_clear_error (&temp_error);
+    }
+
+  return summary;
+}
+
+/* Returns whether the newest commit of ref in the summary has already
+   been pulled, e.g. by the session helper prefetching updates */
+static gboolean
+is_downloaded (XdgAppDir *self,
+               const char *repository,
+               const char *ref,
+               XdgAppSummary *summary)
+{
+  const guint8 *csum;
+  char checksum[65];
+  gs_free char *remote_ref = NULL;
+  gs_free char *local_rev = NULL;
+
+  if (!xdg_app_summary_lookup_ref (summary, ref, &csum))
+    return FALSE;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  remote_ref = g_strdup_printf ("%s:%s", repository, ref);
+  if (!ostree_repo_resolve_rev (self->repo, remote_ref, TRUE, &local_rev, NULL))
+    return FALSE;
+
+  return g_strcmp0 (local_rev, checksum) == 0;
+}
+
+/* Returns whether ostree will pull ref with a static delta from its
+   deployed commit. ostree picks deltas based on the local copy of the
+   remote ref, which is normally what is deployed, but not after
+   deploying an older commit with --commit. */
+static gboolean
+has_update_delta (XdgAppDir *self,
+                  const char *repository,
+                  const char *ref,
+                  XdgAppSummary *summary,
+                  GCancellable *cancellable)
+{
+  const guint8 *csum;
+  char to[65];
+  gs_free char *from = NULL;
+  gs_free char *remote_ref = NULL;
+  gs_free char *local_rev = NULL;
+
+  if (!xdg_app_summary_lookup_ref (summary, ref, &csum))
+    return FALSE;
+
+  ostree_checksum_inplace_from_bytes (csum, to);
+
+  from = xdg_app_dir_read_active (self, ref, cancellable);
+  if (from == NULL || strcmp (from, to) == 0)
+    return FALSE;
+
+  remote_ref = g_strdup_printf ("%s:%s", repository, ref);
+  if (!ostree_repo_resolve_rev (self->repo, remote_ref, TRUE, &local_rev, NULL) ||
+      g_strcmp0 (local_rev, from) != 0)
+    return FALSE;
+
+  return xdg_app_summary_has_static_delta (summary, from, to);
+}
+
+/* Like xdg_app_dir_pull_refs(), but for updating deployed refs. If the
+   remote publishes static deltas from the deployed commits, these are
+   used instead of fetching every changed object separately, and if that
+   fails the objects are pulled after all. @summary is the summary of
+   the remote, or NULL to load it here. */
+gboolean
+xdg_app_dir_pull_updates (XdgAppDir *self,
+                          const char *repository,
+                          const char **refs,
+                          XdgAppSummary *summary,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+  gboolean ret = FALSE;
+  XdgAppSummary *local_summary = NULL;
+  gs_unref_ptrarray GPtrArray *to_pull = NULL;
+  gboolean use_deltas = FALSE;
+  GError *temp_error = NULL;
+  int i;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  /* Without a summary we can still pull objects */
+  if (summary == NULL)
+    summary = local_summary = load_remote_summary (self, repository, cancellable);
+
+  to_pull = g_ptr_array_new ();
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      DeploySubset *subset = NULL;
+
+      if (summary != NULL &&
+          is_downloaded (self, repository, refs[i], summary))
+        {
+          g_print ("%s is already downloaded\n", refs[i]);
+          continue;
+        }
+
+      if (!load_deploy_subset (self, refs[i], &subset, error))
+        goto out;
+
+      /* Subsets are pulled on their own, the rest together below */
+      if (subset != NULL && subset->subpaths != NULL)
+        {
+          gboolean pulled;
+
+          g_print ("Pulling subset of %s\n", refs[i]);
+          pulled = pull_subset (self, repository, refs[i], subset, cancellable, error);
+          deploy_subset_free (subset);
+          if (!pulled)
+            goto out;
+          continue;
+        }
+
+      deploy_subset_free (subset);
+
+      if (summary != NULL &&
+          has_update_delta (self, repository, refs[i], summary, cancellable))
+        {
+          g_print ("Using static delta for %s\n", refs[i]);
+          use_deltas = TRUE;
+        }
+      else
+        g_print ("Pulling objects for %s\n", refs[i]);
+
+      g_ptr_array_add (to_pull, (char *)refs[i]);
+    }
+
+  if (to_pull->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_ptr_array_add (to_pull, NULL);
+  refs = (const char **)to_pull->pdata;
+
+  if (use_deltas)
+    {
+      if (pull_refs (self, repository, refs, NULL, FALSE, cancellable, &temp_error))
+        {
+          ret = TRUE;
+          goto out;
+        }
+
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+
+      g_printerr ("Static delta pull failed, pulling objects instead: %s\n", temp_error->message);
+      g_clear_error (&temp_error);
+    }
+
+  if (!pull_refs (self, repository, refs, NULL, TRUE, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  xdg_app_summary_free (local_summary);
+  return ret;
+}
+
+/* Gets the sizes of the tip of ref from the summary, or else from the
+   local copy of the commit, if that is the current one */
+static gboolean
+get_ref_sizes (XdgAppDir *self,
+               const char *repository,
+               const char *ref,
+               XdgAppSummary *summary,
+               guint64 *out_installed_size,
+               guint64 *out_download_size,
+               GCancellable *cancellable)
+{
+  gs_free char *remote_ref = NULL;
+  gs_free char *local_rev = NULL;
+  gs_unref_variant GVariant *commit_v = NULL;
+  gs_unref_object GFile *root = NULL;
+  const guint8 *csum;
+
+  if (summary != NULL &&
+      xdg_app_summary_lookup_sizes (summary, ref, out_installed_size, out_download_size))
+    return TRUE;
+
+  remote_ref = g_strdup_printf ("%s:%s", repository, ref);
+  if (!ostree_repo_resolve_rev (self->repo, remote_ref, TRUE, &local_rev, NULL) ||
+      local_rev == NULL)
+    return FALSE;
+
+  if (summary != NULL && xdg_app_summary_lookup_ref (summary, ref, &csum))
+    {
+      char checksum[65];
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      if (strcmp (checksum, local_rev) != 0)
+        return FALSE;
+    }
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, local_rev,
+                                 &commit_v, NULL))
+    return FALSE;
+
+  if (xdg_app_commit_get_sizes (commit_v, out_installed_size, out_download_size))
+    return TRUE;
+
+  return ostree_repo_read_commit (self->repo, local_rev, &root, NULL, cancellable, NULL) &&
+    xdg_app_repo_collect_sizes (self->repo, root, out_installed_size, out_download_size,
+                                cancellable, NULL);
+}
+
+/* Prints how much pulling @refs from @repository would download, and how
+   much space they take once deployed, without pulling anything. For refs
+   that are already deployed the download is an upper bound, since
+   unchanged objects are not downloaded again. @summary is the summary of
+   the remote, or NULL to load it here. */
+gboolean
+xdg_app_dir_estimate_pull (XdgAppDir *self,
+                           const char *repository,
+                           const char **refs,
+                           XdgAppSummary *summary,
+                           GCancellable *cancellable,
+                           GError **error)
+{
+  gboolean ret = FALSE;
+  XdgAppSummary *local_summary = NULL;
+  guint64 total_installed_size = 0;
+  guint64 total_download_size = 0;
+  gboolean unknown = FALSE;
+  int i;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  if (summary == NULL)
+    summary = local_summary = load_remote_summary (self, repository, cancellable);
+
+  g_print ("%-50s %12s %12s\n", "Ref", "Download", "Installed");
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      guint64 installed_size, download_size;
+      gs_free char *installed_str = NULL;
+      gs_free char *download_str = NULL;
+
+      if (!get_ref_sizes (self, repository, refs[i], summary,
+                          &installed_size, &download_size, cancellable))
+        {
+          g_print ("%-50s %12s %12s\n", refs[i], "unknown", "unknown");
+          unknown = TRUE;
+          continue;
+        }
+
+      download_str = g_format_size (download_size);
+      installed_str = g_format_size (installed_size);
+      g_print ("%-50s %12s %12s\n", refs[i], download_str, installed_str);
+
+      total_download_size += download_size;
+      total_installed_size += installed_size;
+    }
+
+  if (i > 1)
+    {
+      gs_free char *installed_str = g_format_size (total_installed_size);
+      gs_free char *download_str = g_format_size (total_download_size);
+
+      g_print ("%-50s %12s %12s\n", unknown ? "Total (of known sizes)" : "Total",
+               download_str, installed_str);
+    }
+
+  ret = TRUE;
+ out:
+  xdg_app_summary_free (local_summary);
+  return ret;
+}
+
+char *
+xdg_app_dir_read_active (XdgAppDir *self,
+                         const char *ref,
+                         GCancellable *cancellable)
+{
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *active_link = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  active_link = g_file_get_child (deploy_base, "active");
+
+  file_info = g_file_query_info (active_link, OSTREE_GIO_FAST_QUERYINFO,
+                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                 cancellable, NULL);
+  if (file_info == NULL)
+    return NULL;
+
+  return g_strdup (g_file_info_get_symlink_target (file_info));
+}
+
+/* Returns what the helper mounts for the deployment in deploy_dir:
+   its files directory, or the image of it if it was deployed as one */
+GFile *
+xdg_app_get_deploy_files (GFile *deploy_dir)
+{
+  GFile *image = g_file_get_child (deploy_dir, XDG_APP_DEPLOY_IMAGE);
+
+  if (g_file_query_file_type (image, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_REGULAR)
+    return image;
+
+  g_object_unref (image);
+  return g_file_get_child (deploy_dir, "files");
+}
+
+/* Loads the deploy data written by xdg_app_dir_deploy() at the top of
+   the deployment in deploy_dir. Deployments made by older versions
+   don't have it, which gives a G_IO_ERROR_NOT_FOUND error. */
+GVariant *
+xdg_app_load_deploy_data (GFile *deploy_dir,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+  gs_unref_object GFile *data_file = NULL;
+  char *data = NULL;
+  gsize data_size;
+
+  data_file = g_file_get_child (deploy_dir, "deploy");
+  if (!g_file_load_contents (data_file, cancellable, &data, &data_size, NULL, error))
+    return NULL;
+
+  return g_variant_ref_sink (g_variant_new_from_data (XDG_APP_DEPLOY_DATA_GVARIANT_FORMAT,
+                                                      data, data_size,
+                                                      FALSE, g_free, data));
+}
+
+GVariant *
+xdg_app_dir_get_deploy_data (XdgAppDir *self,
+                             const char *ref,
+                             const char *checksum,
+                             GCancellable *cancellable,
+                             GError **error)
+{
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *deploy_dir = NULL;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  deploy_dir = g_file_get_child (deploy_base, checksum ? checksum : "active");
+
+  return xdg_app_load_deploy_data (deploy_dir, cancellable, error);
+}
+
+const char *
+xdg_app_deploy_data_get_commit (GVariant *deploy_data)
+{
+  const char *commit;
+
+  g_variant_get_child (deploy_data, 0, "&s", &commit);
+  return commit;
+}
+
+guint64
+xdg_app_deploy_data_get_timestamp (GVariant *deploy_data)
+{
+  guint64 timestamp;
+
+  g_variant_get_child (deploy_data, 1, "t", &timestamp);
+  return timestamp;
+}
+
+const char *
+xdg_app_deploy_data_get_metadata (GVariant *deploy_data)
+{
+  const char *metadata;
+
+  g_variant_get_child (deploy_data, 2, "&s", &metadata);
+  return metadata;
+}
+
+guint64
+xdg_app_deploy_data_get_installed_size (GVariant *deploy_data)
+{
+  guint64 installed_size;
+
+  g_variant_get_child (deploy_data, 3, "t", &installed_size);
+  return installed_size;
+}
+
+guint64
+xdg_app_deploy_data_get_n_files (GVariant *deploy_data)
+{
+  guint64 n_files;
+
+  g_variant_get_child (deploy_data, 4, "t", &n_files);
+  return n_files;
+}
+
+/* Returns the files the deployment exports, relative to its export
+   directory. Free the array, but not the strings, with g_free() */
+const char **
+xdg_app_deploy_data_get_exports (GVariant *deploy_data)
+{
+  const char **exports;
+
+  g_variant_get_child (deploy_data, 5, "^a&s", &exports);
+  return exports;
+}
+
+gboolean
+xdg_app_dir_run_triggers (XdgAppDir *self,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_object GFileInfo *child_info = NULL;
+  gs_unref_object GFile *triggersdir = NULL;
+  gs_unref_object GFile *exports = NULL;
+  GError *temp_error = NULL;
+
+  g_debug ("running triggers");
+
+  exports = xdg_app_dir_get_exports_dir (self);
+
+  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+
+  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
+                                        0, cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      gs_unref_object GFile *child = NULL;
+      const char *name;
+      GError *trigger_error = NULL;
+
+      name = g_file_info_get_name (child_info);
+
+      child = g_file_get_child (triggersdir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
+	  g_str_has_suffix (name, ".trigger"))
+	{
+	  gs_unref_ptrarray GPtrArray *argv_array = NULL;
+
+	  g_debug ("running trigger %s", name);
+
+	  argv_array = g_ptr_array_new_with_free_func (g_free);
+	  g_ptr_array_add (argv_array, g_strdup (HELPER));
+	  g_ptr_array_add (argv_array, g_strdup ("-a"));
+	  g_ptr_array_add (argv_array, g_file_get_path (self->basedir));
+	  g_ptr_array_add (argv_array, g_strdup ("-e"));
+	  g_ptr_array_add (argv_array, g_strdup ("-F"));
+	  g_ptr_array_add (argv_array, g_strdup ("/usr"));
+	  g_ptr_array_add (argv_array, g_file_get_path (child));
+	  g_ptr_array_add (argv_array, NULL);
+
+	  if (!g_spawn_sync ("/",
+			     (char **)argv_array->pdata,
+			     NULL,
+			     G_SPAWN_DEFAULT,
+			     NULL, NULL,
+			     NULL, NULL,
+			     NULL, &trigger_error))
+	    {
+	      g_warning ("Error running trigger %s: %s", name, trigger_error->message);
+	      g_clear_error (&trigger_error);
+	    }
+	}
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+read_fd (int           fd,
+         struct stat  *stat_buf,
+         gchar       **contents,
+         gsize        *length,
+         GError      **error)
+{
+  gchar *buf;
+  gsize bytes_read;
+  gsize size;
+  gsize alloc_size;
+
+  size = stat_buf->st_size;
+
+  alloc_size = size + 1;
+  buf = g_try_malloc (alloc_size);
+
+  if (buf == NULL)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_NOMEM,
+                   "not enough memory");
+      return FALSE;
+    }
+
+  bytes_read = 0;
+  while (bytes_read < size)
+    {
+      gssize rc;
+
+      rc = read (fd, buf + bytes_read, size - bytes_read);
+
+      if (rc < 0)
+        {
+          if (errno != EINTR)
+            {
+              int save_errno = errno;
+
+              g_free (buf);
+              g_set_error (error,
+                           G_FILE_ERROR,
+                           g_file_error_from_errno (save_errno),
                            "Failed to read from exported file");
               return FALSE;
             }
         }
-      else if (rc == 0)
-        break;
-      else
-        bytes_read += rc;
+      else if (rc == 0)
+        break;
+      else
+        bytes_read += rc;
+    }
+
+  buf[bytes_read] = '\0';
+
+  if (length)
+    *length = bytes_read;
+
+  *contents = buf;
+
+  return TRUE;
+}
+
+/* Unescapes a string value of a desktop file like
+   g_key_file_get_string() does. Returns NULL for invalid escapes. */
+static char *
+unescape_desktop_value (const char *value,
+                        gsize       len)
+{
+  GString *unescaped = g_string_sized_new (len);
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (value[i] != '\\')
+        {
+          g_string_append_c (unescaped, value[i]);
+          continue;
+        }
+
+      if (++i == len)
+        goto invalid;
+
+      switch (value[i])
+        {
+        case 's':
+          g_string_append_c (unescaped, ' ');
+          break;
+        case 'n':
+          g_string_append_c (unescaped, '\n');
+          break;
+        case 't':
+          g_string_append_c (unescaped, '\t');
+          break;
+        case 'r':
+          g_string_append_c (unescaped, '\r');
+          break;
+        case '\\':
+          g_string_append_c (unescaped, '\\');
+          break;
+        default:
+          goto invalid;
+        }
+    }
+
+  return g_string_free (unescaped, FALSE);
+
+ invalid:
+  g_string_free (unescaped, TRUE);
+  return NULL;
+}
+
+/* Appends an Exec line that runs app with xdg-app, passing on the
+   command line of old_exec, if there is one */
+static void
+append_exec_line (GString    *out,
+                  const char *app,
+                  const char *branch,
+                  const char *arch,
+                  const char *old_exec)
+{
+  GString *new_exec = g_string_new ("");
+  gs_free char *escaped_app = g_shell_quote (app);
+  gs_strfreev char **old_argv = NULL;
+  int old_argc;
+  const char *p;
+  int i;
+
+  g_string_append_printf (new_exec, XDG_APP_BINDIR"/xdg-app run --branch='%s' --arch='%s'", branch, arch);
+
+  if (old_exec && g_shell_parse_argv (old_exec, &old_argc, &old_argv, NULL) && old_argc >= 1)
+    {
+      gs_free char *command = g_shell_quote (old_argv[0]);
+
+      g_string_append_printf (new_exec, " --command=%s", command);
+
+      g_string_append (new_exec, " ");
+      g_string_append (new_exec, escaped_app);
+
+      for (i = 1; i < old_argc; i++)
+        {
+          gs_free char *arg = g_shell_quote (old_argv[i]);
+          g_string_append (new_exec, " ");
+          g_string_append (new_exec, arg);
+        }
+    }
+  else
+    {
+      g_string_append (new_exec, " ");
+      g_string_append (new_exec, escaped_app);
+    }
+
+  /* Escaped as by g_key_file_set_string(), the value never starts
+     with a space */
+  g_string_append (out, G_KEY_FILE_DESKTOP_KEY_EXEC "=");
+  for (p = new_exec->str; *p != 0; p++)
+    {
+      switch (*p)
+        {
+        case '\n':
+          g_string_append (out, "\\n");
+          break;
+        case '\t':
+          g_string_append (out, "\\t");
+          break;
+        case '\r':
+          g_string_append (out, "\\r");
+          break;
+        case '\\':
+          g_string_append (out, "\\\\");
+          break;
+        default:
+          g_string_append_c (out, *p);
+        }
+    }
+  g_string_append_c (out, '\n');
+
+  g_string_free (new_exec, TRUE);
+}
+
+static gboolean
+key_equal (const char *key,
+           gsize       key_len,
+           const char *name)
+{
+  return key_len == strlen (name) && strncmp (key, name, key_len) == 0;
+}
+
+/* Rewrites a desktop or service file line by line, rather than going
+   through a GKeyFile. Every group gets an Exec line that runs the app
+   with xdg-app, and TryExec and the bugzilla script are removed, so
+   that nothing tries to execute them outside the sandbox. Everything
+   else is kept as it is. The D-Bus name of a service file is returned
+   in out_dbus_name. */
+static gboolean
+rewrite_desktop_data (const char *data,
+                      gsize       data_len,
+                      const char *app,
+                      const char *branch,
+                      const char *arch,
+                      GString    *out,
+                      char      **out_dbus_name,
+                      GError    **error)
+{
+  const char *line = data;
+  const char *end = data + data_len;
+  gboolean in_group = FALSE;
+  gboolean group_has_exec = FALSE;
+  gboolean in_dbus_group = FALSE;
+  gsize group_end = 0;
+  gs_free char *dbus_name = NULL;
+
+  while (line < end)
+    {
+      const char *eol = memchr (line, '\n', end - line);
+      const char *line_end = eol ? eol : end;
+      const char *next = eol ? eol + 1 : end;
+      const char *p = line;
+      const char *equals;
+      const char *key_end;
+      const char *value;
+
+      while (p < line_end && g_ascii_isspace (*p))
+        p++;
+
+      /* Blank lines and comments stay, but a missing Exec line goes
+         before the ones that end a group */
+      if (p == line_end || *p == '#')
+        {
+          g_string_append_len (out, line, line_end - line);
+          g_string_append_c (out, '\n');
+          line = next;
+          continue;
+        }
+
+      if (*p == '[')
+        {
+          if (in_group && !group_has_exec)
+            {
+              GString *exec_line = g_string_new ("");
+
+              append_exec_line (exec_line, app, branch, arch, NULL);
+              g_string_insert (out, group_end, exec_line->str);
+              g_string_free (exec_line, TRUE);
+            }
+
+          in_group = TRUE;
+          group_has_exec = FALSE;
+          in_dbus_group = g_str_has_prefix (p, "[D-BUS Service]");
+
+          g_string_append_len (out, line, line_end - line);
+          g_string_append_c (out, '\n');
+          group_end = out->len;
+          line = next;
+          continue;
+        }
+
+      equals = memchr (p, '=', line_end - p);
+      if (!in_group || equals == NULL)
+        {
+          g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
+                       "Invalid line '%.*s'", (int)(line_end - line), line);
+          return FALSE;
+        }
+
+      key_end = equals;
+      while (key_end > p && g_ascii_isspace (key_end[-1]))
+        key_end--;
+
+      value = equals + 1;
+      while (value < line_end && g_ascii_isspace (*value))
+        value++;
+
+      if (key_equal (p, key_end - p, "TryExec") ||
+          key_equal (p, key_end - p, "X-GNOME-Bugzilla-ExtraInfoScript"))
+        {
+          line = next;
+          continue;
+        }
+
+      if (key_equal (p, key_end - p, G_KEY_FILE_DESKTOP_KEY_EXEC))
+        {
+          gs_free char *old_exec = unescape_desktop_value (value, line_end - value);
+
+          append_exec_line (out, app, branch, arch, old_exec);
+          group_has_exec = TRUE;
+        }
+      else
+        {
+          if (in_dbus_group && key_equal (p, key_end - p, "Name"))
+            {
+              g_free (dbus_name);
+              dbus_name = unescape_desktop_value (value, line_end - value);
+            }
+
+          g_string_append_len (out, line, line_end - line);
+          g_string_append_c (out, '\n');
+        }
+
+      group_end = out->len;
+      line = next;
+    }
+
+  if (in_group && !group_has_exec)
+    {
+      GString *exec_line = g_string_new ("");
+
+      append_exec_line (exec_line, app, branch, arch, NULL);
+      g_string_insert (out, group_end, exec_line->str);
+      g_string_free (exec_line, TRUE);
+    }
+
+  gs_transfer_out_value (out_dbus_name, &dbus_name);
+  return TRUE;
+}
+
+/* Returns the name of the rewritten file in the export cache. It
+   depends on everything that goes into rewriting it. */
+static char *
+get_export_cache_key (const char *app,
+                      const char *branch,
+                      const char *arch,
+                      const char *name,
+                      const char *data,
+                      gsize       data_len)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  const char *parts[] = { XDG_APP_BINDIR, app, branch, arch, name };
+  char *key;
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (parts); i++)
+    g_checksum_update (checksum, (const guchar *)parts[i], strlen (parts[i]) + 1);
+  g_checksum_update (checksum, (const guchar *)data, data_len);
+
+  key = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+  return key;
+}
+
+/* Writes the rewritten version of the desktop or service file name to
+   a temporary file next to it, returned in target. If cache_dfd is not
+   -1, the rewritten file is hardlinked from the export cache when the
+   same file was rewritten before for the same app, branch and arch,
+   which is the case for most files on updates. */
+static gboolean
+export_desktop_file (const char    *app,
+                     const char    *branch,
+                     const char    *arch,
+                     int            parent_fd,
+                     const char    *name,
+                     struct stat   *stat_buf,
+                     int            cache_dfd,
+                     char         **target,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_fd_close int desktop_fd = -1;
+  gs_free char *tmpfile_name = NULL;
+  gs_free char *cache_key = NULL;
+  gs_free char *dbus_name = NULL;
+  gs_unref_object GOutputStream *out_stream = NULL;
+  gs_free gchar *data = NULL;
+  gsize data_len;
+  GString *new_data = NULL;
+
+  if (!gs_file_openat_noatime (parent_fd, name, &desktop_fd, cancellable, error))
+    goto out;
+
+  if (!read_fd (desktop_fd, stat_buf, &data, &data_len, error))
+    goto out;
+
+  if (cache_dfd != -1)
+    {
+      cache_key = get_export_cache_key (app, branch, arch, name, data, data_len);
+      tmpfile_name = gs_fileutil_gen_tmp_name (".export-", NULL);
+
+      if (linkat (cache_dfd, cache_key, parent_fd, tmpfile_name, 0) == 0)
+        {
+          gs_transfer_out_value (target, &tmpfile_name);
+          ret = TRUE;
+          goto out;
+        }
+
+      g_clear_pointer (&tmpfile_name, g_free);
+    }
+
+  new_data = g_string_sized_new (data_len + 256);
+  if (!rewrite_desktop_data (data, data_len, app, branch, arch,
+                             new_data, &dbus_name, error))
+    {
+      g_prefix_error (error, "Invalid exported file %s: ", name);
+      goto out;
+    }
+
+  if (g_str_has_suffix (name, ".service"))
+    {
+      gs_free gchar *expected_dbus_name = g_strndup (name, strlen (name) - strlen (".service"));
+
+      if (dbus_name == NULL || strcmp (dbus_name, expected_dbus_name) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "dbus service file %s has wrong name", name);
+          goto out;
+        }
+    }
+
+  if (!gs_file_open_in_tmpdir_at (parent_fd, 0755, &tmpfile_name, &out_stream, cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (out_stream, new_data->str, new_data->len, NULL, cancellable, error))
+    goto out;
+
+  if (!g_output_stream_close (out_stream, cancellable, error))
+    goto out;
+
+  /* Sharing the file with later deployments is only an optimization */
+  if (cache_dfd != -1 &&
+      linkat (parent_fd, tmpfile_name, cache_dfd, cache_key, 0) != 0 &&
+      errno != EEXIST)
+    g_debug ("Can't add %s to the export cache: %s", name, g_strerror (errno));
+
+  gs_transfer_out_value (target, &tmpfile_name);
+
+  ret = TRUE;
+ out:
+
+  if (new_data != NULL)
+    g_string_free (new_data, TRUE);
+
+  return ret;
+}
+
+static int
+get_checkout_threads (void)
+{
+  const char *env = g_getenv ("XDG_APP_CHECKOUT_THREADS");
+
+  if (env != NULL && *env != 0)
+    return MAX (atoi (env), 1);
+
+  return g_get_num_processors ();
+}
+
+typedef struct {
+  const char *app;
+  const char *branch;
+  const char *arch;
+  int cache_dfd;
+  GCancellable *cancellable;
+
+  GMutex lock;
+  GError *error;
+  guint error_index;
+} ExportContext;
+
+/* The desktop and service files of one exported directory */
+typedef struct {
+  guint index;
+  int dfd;
+  GPtrArray *names;
+} ExportJob;
+
+static void
+export_job_free (ExportJob *job)
+{
+  if (job->dfd != -1)
+    close (job->dfd);
+  g_ptr_array_unref (job->names);
+  g_free (job);
+}
+
+/* Walks the export directory source_name, warning about what can't be
+   exported, and adds a job for every directory with desktop or service
+   files to jobs. relpath is a buffer holding the path of the directory
+   below the export root, it is restored before returning. */
+static gboolean
+queue_export_dir (ExportContext *context,
+                  int            source_parent_fd,
+                  const char    *source_name,
+                  GString       *relpath,
+                  GPtrArray     *jobs,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_dirfd_iterator_cleanup GSDirFdIterator source_iter;
+  struct dirent *dent;
+  ExportJob *job = NULL;
+  gsize relpath_len = relpath->len;
+
+  if (!gs_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      unsigned char d_type;
+
+      if (!gs_dirfd_iterator_next_dent (&source_iter, &dent, context->cancellable, error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      d_type = dent->d_type;
+      if (d_type == DT_UNKNOWN)
+        {
+          struct stat stbuf;
+
+          if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              int errsv = errno;
+              if (errsv == ENOENT)
+                continue;
+              else
+                {
+                  gs_set_error_from_errno (error, errsv);
+                  goto out;
+                }
+            }
+
+          d_type = IFTODT (stbuf.st_mode);
+        }
+
+      if (d_type == DT_DIR)
+        {
+          g_string_append (relpath, dent->d_name);
+          g_string_append_c (relpath, '/');
+
+          if (!queue_export_dir (context, source_iter.fd, dent->d_name, relpath, jobs, error))
+            goto out;
+
+          g_string_truncate (relpath, relpath_len);
+        }
+      else if (d_type == DT_REG)
+        {
+          if (!xdg_app_has_name_prefix (dent->d_name, context->app))
+            {
+              g_warning ("Non-prefixed filename %s in app %s, ignoring.\n", dent->d_name, context->app);
+              continue;
+            }
+
+          if (g_str_has_suffix (dent->d_name, ".desktop") || g_str_has_suffix (dent->d_name, ".service"))
+            {
+              if (job == NULL)
+                {
+                  job = g_new0 (ExportJob, 1);
+                  job->dfd = -1;
+                  job->names = g_ptr_array_new_with_free_func (g_free);
+                }
+
+              g_ptr_array_add (job->names, g_strdup (dent->d_name));
+            }
+        }
+      else
+        {
+          g_warning ("Not exporting file %s of unsupported type\n", relpath->str);
+        }
+    }
+
+  if (job)
+    {
+      /* The files are only rewritten after the walk, so nothing it
+         creates can show up in it */
+      job->dfd = fcntl (source_iter.fd, F_DUPFD_CLOEXEC, 3);
+      if (job->dfd == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      job->index = jobs->len;
+      g_ptr_array_add (jobs, job);
+      job = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  if (job)
+    export_job_free (job);
+  return ret;
+}
+
+static gboolean
+run_export_job (ExportContext *context,
+                ExportJob     *job,
+                GError       **error)
+{
+  int i;
+
+  for (i = 0; i < job->names->len; i++)
+    {
+      const char *name = g_ptr_array_index (job->names, i);
+      gs_free gchar *new_name = NULL;
+      struct stat stbuf;
+
+      if (fstatat (job->dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+
+      if (!export_desktop_file (context->app, context->branch, context->arch,
+                                job->dfd, name, &stbuf, context->cache_dfd,
+                                &new_name, context->cancellable, error))
+        return FALSE;
+
+      if (renameat (job->dfd, new_name, job->dfd, name) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+export_job_thread (gpointer data,
+                   gpointer user_data)
+{
+  ExportJob *job = data;
+  ExportContext *context = user_data;
+  GError *error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&context->lock);
+  failed = context->error != NULL;
+  g_mutex_unlock (&context->lock);
+
+  if (failed || run_export_job (context, job, &error))
+    return;
+
+  /* Keep the error of the first job in walk order, as the single
+     threaded export would report it */
+  g_mutex_lock (&context->lock);
+  if (context->error == NULL || job->index < context->error_index)
+    {
+      g_clear_error (&context->error);
+      context->error = error;
+      context->error_index = job->index;
+      error = NULL;
+    }
+  g_mutex_unlock (&context->lock);
+
+  g_clear_error (&error);
+}
+
+/* Rewrites the desktop and service files in source, the export
+   directory of a deployment, to run the app with xdg-app, replacing
+   each of them with a rename. The tree is walked first, and the files
+   are then rewritten on a thread pool, one job per directory, with as
+   many threads as checkouts use. The links to the exported files are
+   made by sync_ref_exports() when the deployment becomes active. */
+static gboolean
+export_dir (const char    *app,
+            const char    *branch,
+            const char    *arch,
+            const char    *source,
+            int            cache_dfd,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  gboolean ret = FALSE;
+  ExportContext context = { 0, };
+  gs_unref_ptrarray GPtrArray *jobs = NULL;
+  GString *relpath = g_string_new ("");
+  GThreadPool *pool = NULL;
+  int n_threads;
+  int i;
+
+  context.app = app;
+  context.branch = branch;
+  context.arch = arch;
+  context.cache_dfd = cache_dfd;
+  context.cancellable = cancellable;
+  g_mutex_init (&context.lock);
+
+  jobs = g_ptr_array_new_with_free_func ((GDestroyNotify)export_job_free);
+
+  if (!queue_export_dir (&context, AT_FDCWD, source, relpath, jobs, error))
+    goto out;
+
+  n_threads = MIN (get_checkout_threads (), (int)jobs->len);
+  if (n_threads <= 1)
+    {
+      for (i = 0; i < jobs->len; i++)
+        {
+          if (!run_export_job (&context, g_ptr_array_index (jobs, i), error))
+            goto out;
+        }
+    }
+  else
+    {
+      pool = g_thread_pool_new (export_job_thread, &context, n_threads, FALSE, error);
+      if (pool == NULL)
+        goto out;
+
+      for (i = 0; i < jobs->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+
+      if (context.error)
+        {
+          g_propagate_error (error, context.error);
+          context.error = NULL;
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_string_free (relpath, TRUE);
+  g_clear_error (&context.error);
+  g_mutex_clear (&context.lock);
+  return ret;
+}
+
+/* Returns the target of the link in the exports directory for the
+   file path that ref exports. It goes through the active link of ref,
+   so it stays the same when another deployment becomes active. */
+static char *
+get_export_link_target (const char *ref,
+                        const char *path)
+{
+  GString *target = g_string_new ("../");
+  const char *p;
+
+  /* One level up for every directory of path, and one more to get
+     from exports/ to the base directory */
+  for (p = path; *p != 0; p++)
+    {
+      if (*p == '/')
+        g_string_append (target, "../");
+    }
+
+  g_string_append_printf (target, "%s/active/export/%s", ref, path);
+  return g_string_free (target, FALSE);
+}
+
+/* Returns whether the link at path in the exports directory points
+   into the deployments of ref, either through its active link or
+   directly at a deployment, as made by older versions */
+static gboolean
+export_link_is_owned (int exports_dfd,
+                      const char *ref,
+                      const char *path)
+{
+  gs_free char *target = get_export_link_target (ref, path);
+  char buf[PATH_MAX];
+  ssize_t len;
+  gsize prefix_len;
+
+  len = readlinkat (exports_dfd, path, buf, sizeof (buf) - 1);
+  if (len < 0)
+    return FALSE;
+  buf[len] = 0;
+
+  prefix_len = strlen (target) - strlen ("active/export/") - strlen (path);
+  return strncmp (buf, target, prefix_len) == 0;
+}
+
+/* Links path in the exports directory to target, unless it already
+   is, creating the directories it is in */
+static gboolean
+add_export_link (int exports_dfd,
+                 const char *path,
+                 const char *target,
+                 GError **error)
+{
+  gs_free char *parent = NULL;
+  char buf[PATH_MAX];
+  ssize_t len;
+  char *slash;
+
+  len = readlinkat (exports_dfd, path, buf, sizeof (buf) - 1);
+  if (len >= 0)
+    {
+      buf[len] = 0;
+      if (strcmp (buf, target) == 0)
+        return TRUE;
+    }
+
+  parent = g_strdup (path);
+  for (slash = strchr (parent, '/'); slash != NULL; slash = strchr (slash + 1, '/'))
+    {
+      *slash = 0;
+      if (mkdirat (exports_dfd, parent, 0777) != 0 && errno != EEXIST)
+        {
+          gs_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+      *slash = '/';
+    }
+
+  if ((unlinkat (exports_dfd, path, 0) != 0 && errno != ENOENT) ||
+      symlinkat (target, exports_dfd, path) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Adds up the files below name, and collects the ones in export/ that
+   are exported for app, i.e. regular files with its name as prefix */
+static gboolean
+scan_deployment (int parent_dfd,
+                 const char *name,
+                 const char *path,
+                 const char *app,
+                 guint64 *installed_size,
+                 guint64 *n_files,
+                 GPtrArray *exports,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+  gboolean ret = FALSE;
+  gs_dirfd_iterator_cleanup GSDirFdIterator iter;
+  struct dirent *dent;
+
+  if (!gs_dirfd_iterator_init_at (parent_dfd, name, FALSE, &iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+      gs_free char *child_path = NULL;
+
+      if (!gs_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      child_path = g_build_filename (path, dent->d_name, NULL);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!scan_deployment (iter.fd, dent->d_name, child_path, app,
+                                installed_size, n_files, exports,
+                                cancellable, error))
+            goto out;
+        }
+      else
+        {
+          *n_files += 1;
+          if (S_ISREG (stbuf.st_mode))
+            *installed_size += stbuf.st_size;
+
+          if (app != NULL && S_ISREG (stbuf.st_mode) &&
+              g_str_has_prefix (child_path, "export/") &&
+              xdg_app_has_name_prefix (dent->d_name, app))
+            g_ptr_array_add (exports, g_strdup (child_path + strlen ("export/")));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+collect_refs (GFile        *dir,
+              const char   *prefix,
+              int           depth,
+              GPtrArray    *refs,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_object GFileInfo *child_info = NULL;
+  GError *temp_error = NULL;
+
+  if (depth == 0)
+    {
+      gs_unref_object GFile *active = g_file_get_child (dir, "active");
+
+      if (g_file_query_exists (active, cancellable))
+        g_ptr_array_add (refs, g_strdup (prefix));
+      return TRUE;
+    }
+
+  dir_enum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable,
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      const char *name = g_file_info_get_name (child_info);
+
+      /* The app dir also holds the per-app "data" directory */
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY &&
+          name[0] != '.' && (depth != 2 || strcmp (name, "data") != 0))
+        {
+          gs_unref_object GFile *child = g_file_get_child (dir, name);
+          gs_free char *child_prefix = g_build_filename (prefix, name, NULL);
+
+          if (!collect_refs (child, child_prefix, depth - 1, refs, cancellable, error))
+            goto out;
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Returns the files the deployment of checksum exports, from its
+   deploy data, or by scanning its export directory if it was made by
+   an older version. A deployment that is gone exports nothing. */
+static char **
+load_deployment_exports (XdgAppDir *self,
+                         const char *ref,
+                         const char *checksum,
+                         GCancellable *cancellable,
+                         GError **error)
+{
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *checkoutdir = NULL;
+  gs_unref_object GFile *export = NULL;
+  gs_unref_variant GVariant *deploy_data = NULL;
+  gs_unref_ptrarray GPtrArray *exports = NULL;
+  gs_strfreev char **ref_parts = NULL;
+  guint64 installed_size = 0;
+  guint64 n_files = 0;
+  char **result;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  checkoutdir = g_file_get_child (deploy_base, checksum);
+
+  deploy_data = xdg_app_load_deploy_data (checkoutdir, cancellable, NULL);
+  if (deploy_data != NULL)
+    {
+      gs_free const char **deploy_exports = xdg_app_deploy_data_get_exports (deploy_data);
+      return g_strdupv ((char **)deploy_exports);
+    }
+
+  exports = g_ptr_array_new_with_free_func (g_free);
+
+  export = g_file_get_child (checkoutdir, "export");
+  if (g_file_query_exists (export, cancellable))
+    {
+      ref_parts = g_strsplit (ref, "/", -1);
+      if (!scan_deployment (AT_FDCWD, gs_file_get_path_cached (export), "export",
+                            ref_parts[1], &installed_size, &n_files, exports,
+                            cancellable, error))
+        return NULL;
+    }
+
+  g_ptr_array_add (exports, NULL);
+  result = (char **)g_ptr_array_free (exports, FALSE);
+  exports = NULL;
+
+  return result;
+}
+
+/* Maps the files exported by the active deployments of the other
+   arches and branches of the app of ref to their refs. Exported files
+   are named after the app, so these are the only refs that can take
+   over a link that ref drops. */
+static gboolean
+load_sibling_exports (XdgAppDir *self,
+                      const char *ref,
+                      GHashTable **out_sibling_exports,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *sibling_exports = NULL;
+  gs_unref_ptrarray GPtrArray *siblings = NULL;
+  gs_unref_object GFile *app_dir = NULL;
+  gs_strfreev char **ref_parts = NULL;
+  gs_free char *app_prefix = NULL;
+  int i, j;
+
+  ref_parts = g_strsplit (ref, "/", -1);
+  app_prefix = g_build_filename ("app", ref_parts[1], NULL);
+  app_dir = xdg_app_dir_get_deploy_dir (self, app_prefix);
+
+  siblings = g_ptr_array_new_with_free_func (g_free);
+  if (!collect_refs (app_dir, app_prefix, 2, siblings, cancellable, error))
+    goto out;
+
+  sibling_exports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  for (i = 0; i < siblings->len; i++)
+    {
+      const char *sibling = g_ptr_array_index (siblings, i);
+      gs_free char *active = NULL;
+      gs_strfreev char **exports = NULL;
+
+      if (strcmp (sibling, ref) == 0)
+        continue;
+
+      active = xdg_app_dir_read_active (self, sibling, cancellable);
+      if (active == NULL)
+        continue;
+
+      exports = load_deployment_exports (self, sibling, active, cancellable, error);
+      if (exports == NULL)
+        goto out;
+
+      for (j = 0; exports[j] != NULL; j++)
+        g_hash_table_insert (sibling_exports, g_strdup (exports[j]), g_strdup (sibling));
+    }
+
+  gs_transfer_out_value (out_sibling_exports, &sibling_exports);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Makes the exports directory match the deployment of new_checksum of
+   ref, which just became active instead of old_checksum. Both can be
+   NULL. As the links go through the active link of ref, only the
+   files that one of the two deployments exports and the other doesn't
+   are linked or unlinked, and this doesn't depend on how much else is
+   installed. Links of files that another branch of the app exports
+   now are left alone, and the links that ref drops are handed over to
+   another branch that exports the same file, if there is one. */
+static gboolean
+sync_ref_exports (XdgAppDir *self,
+                  const char *ref,
+                  const char *old_checksum,
+                  const char *new_checksum,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  gboolean ret = FALSE;
+  gs_strfreev char **old_exports = NULL;
+  gs_strfreev char **new_exports = NULL;
+  gs_unref_hashtable GHashTable *exported = NULL;
+  gs_unref_hashtable GHashTable *sibling_exports = NULL;
+  gs_unref_object GFile *exports = NULL;
+  gs_fd_close int exports_dfd = -1;
+  int i;
+
+  if (!g_str_has_prefix (ref, "app/"))
+    return TRUE;
+
+  if (old_checksum != NULL)
+    {
+      old_exports = load_deployment_exports (self, ref, old_checksum, cancellable, error);
+      if (old_exports == NULL)
+        goto out;
+    }
+
+  if (new_checksum != NULL)
+    {
+      new_exports = load_deployment_exports (self, ref, new_checksum, cancellable, error);
+      if (new_exports == NULL)
+        goto out;
+    }
+
+  if ((old_exports == NULL || old_exports[0] == NULL) &&
+      (new_exports == NULL || new_exports[0] == NULL))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  exports = xdg_app_dir_get_exports_dir (self);
+  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd_at (AT_FDCWD, gs_file_get_path_cached (exports),
+                               &exports_dfd, cancellable, error))
+    goto out;
+
+  exported = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; new_exports != NULL && new_exports[i] != NULL; i++)
+    {
+      gs_free char *target = get_export_link_target (ref, new_exports[i]);
+
+      if (!add_export_link (exports_dfd, new_exports[i], target, error))
+        {
+          g_prefix_error (error, "While exporting %s: ", new_exports[i]);
+          goto out;
+        }
+
+      g_hash_table_add (exported, new_exports[i]);
+    }
+
+  for (i = 0; old_exports != NULL && old_exports[i] != NULL; i++)
+    {
+      const char *sibling;
+
+      if (g_hash_table_contains (exported, old_exports[i]) ||
+          !export_link_is_owned (exports_dfd, ref, old_exports[i]))
+        continue;
+
+      if (sibling_exports == NULL &&
+          !load_sibling_exports (self, ref, &sibling_exports, cancellable, error))
+        goto out;
+
+      sibling = g_hash_table_lookup (sibling_exports, old_exports[i]);
+      if (sibling != NULL)
+        {
+          gs_free char *target = get_export_link_target (sibling, old_exports[i]);
+
+          if (!add_export_link (exports_dfd, old_exports[i], target, error))
+            {
+              g_prefix_error (error, "While exporting %s: ", old_exports[i]);
+              goto out;
+            }
+        }
+      else if (unlinkat (exports_dfd, old_exports[i], 0) != 0 && errno != ENOENT)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+gboolean
+xdg_app_dir_set_active (XdgAppDir *self,
+                        const char *ref,
+                        const char *checksum,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_free char *tmpname = NULL;
+  gs_unref_object GFile *active_tmp_link = NULL;
+  gs_unref_object GFile *active_link = NULL;
+  gs_free_error GError *my_error = NULL;
+  gs_free char *old_active = NULL;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  active_link = g_file_get_child (deploy_base, "active");
+
+  old_active = xdg_app_dir_read_active (self, ref, cancellable);
+
+  if (checksum != NULL)
+    {
+      tmpname = gs_fileutil_gen_tmp_name (".active-", NULL);
+      active_tmp_link = g_file_get_child (deploy_base, tmpname);
+      if (!g_file_make_symbolic_link (active_tmp_link, checksum, cancellable, error))
+        goto out;
+
+      if (!gs_file_rename (active_tmp_link,
+                           active_link,
+                           cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!g_file_delete (active_link, cancellable, &my_error) &&
+          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, my_error);
+          my_error = NULL;
+          goto out;
+        }
+    }
+
+  if (g_strcmp0 (old_active, checksum) != 0 &&
+      !sync_ref_exports (self, ref, old_active, checksum, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* The links of a ref are updated whenever its active deployment
+   changes, see sync_ref_exports(), so this only runs the triggers.
+   Deploy and undeploy don't call it themselves, so that a command
+   changing several apps only runs them once at the end. */
+gboolean
+xdg_app_dir_update_exports (XdgAppDir *self,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *exports = NULL;
+
+  exports = xdg_app_dir_get_exports_dir (self);
+
+  if (g_file_query_exists (exports, cancellable))
+    {
+      if (!xdg_app_dir_run_triggers (self, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+
+ out:
+  return ret;
+}
+
+/* Removes the dangling links in the whole exports directory, e.g. left
+   by older versions or an interrupted update, and links the files of
+   the active deployments of apps that are missing. This walks all
+   exports, so it is only done on request. */
+gboolean
+xdg_app_dir_verify_exports (XdgAppDir *self,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *exports = NULL;
+  gs_strfreev char **refs = NULL;
+  gs_fd_close int exports_dfd = -1;
+  int i, j;
+
+  exports = xdg_app_dir_get_exports_dir (self);
+  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
+    goto out;
+
+  if (!xdg_app_remove_dangling_symlinks (exports, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd_at (AT_FDCWD, gs_file_get_path_cached (exports),
+                               &exports_dfd, cancellable, error))
+    goto out;
+
+  if (!xdg_app_dir_list_refs (self, "app", &refs, cancellable, error))
+    goto out;
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      gs_free char *active = NULL;
+      gs_strfreev char **ref_exports = NULL;
+
+      active = xdg_app_dir_read_active (self, refs[i], cancellable);
+      if (active == NULL)
+        continue;
+
+      ref_exports = load_deployment_exports (self, refs[i], active, cancellable, error);
+      if (ref_exports == NULL)
+        goto out;
+
+      /* Links of another branch of the app are left alone */
+      for (j = 0; ref_exports[j] != NULL; j++)
+        {
+          gs_free char *target = NULL;
+          struct stat stbuf;
+
+          if (fstatat (exports_dfd, ref_exports[j], &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+            continue;
+
+          g_debug ("Exporting missing %s of %s", ref_exports[j], refs[i]);
+
+          target = get_export_link_target (refs[i], ref_exports[j]);
+          if (!add_export_link (exports_dfd, ref_exports[j], target, error))
+            {
+              g_prefix_error (error, "While exporting %s: ", ref_exports[j]);
+              goto out;
+            }
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Recreates the directory source_name as destination_name, with the
+   same metadata and hardlinks to all the files in it */
+static gboolean
+clone_tree_dir (int            source_parent_fd,
+                const char    *source_name,
+                int            destination_parent_fd,
+                const char    *destination_name,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_dirfd_iterator_cleanup GSDirFdIterator source_iter;
+  gs_fd_close int destination_dfd = -1;
+  struct dirent *dent;
+  struct stat stbuf;
+
+  if (!gs_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
+    goto out;
+
+  if (fstat (source_iter.fd, &stbuf) != 0 ||
+      mkdirat (destination_parent_fd, destination_name, 0700) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
+                               &destination_dfd,
+                               cancellable, error))
+    goto out;
+
+  while (TRUE)
+    {
+      gboolean is_dir;
+
+      if (!gs_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_UNKNOWN)
+        {
+          struct stat child_stbuf;
+
+          if (fstatat (source_iter.fd, dent->d_name, &child_stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+          is_dir = S_ISDIR (child_stbuf.st_mode);
+        }
+      else
+        is_dir = dent->d_type == DT_DIR;
+
+      if (is_dir)
+        {
+          if (!clone_tree_dir (source_iter.fd, dent->d_name,
+                               destination_dfd, dent->d_name,
+                               cancellable, error))
+            goto out;
+        }
+      else if (linkat (source_iter.fd, dent->d_name, destination_dfd, dent->d_name, 0) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  /* Only now, as the directory may be read-only. A user checkout has
+     no owners or xattrs to keep. */
+  if (getuid () == 0 &&
+      (fchown (destination_dfd, stbuf.st_uid, stbuf.st_gid) != 0 ||
+       !copy_xattrs (source_iter.fd, destination_dfd, error)))
+    {
+      if (error && *error == NULL)
+        gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (fchmod (destination_dfd, stbuf.st_mode & 07777) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+checkout_subpath (XdgAppDir *self,
+                  const char *checksum,
+                  const char *subpath,
+                  const char *destination,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  OstreeRepoCheckoutOptions options = { 0, };
+
+  options.mode = self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+  options.devino_to_csum_cache = self->devino_cache;
+  options.subpath = subpath;
+
+  return ostree_repo_checkout_tree_at (self->repo, &options, AT_FDCWD, destination,
+                                       checksum, cancellable, error);
+}
+
+static gboolean
+set_xattrs (int fd,
+            GVariant *xattrs,
+            GError **error)
+{
+  GVariantIter iter;
+  const guint8 *name;
+  GVariant *value;
+
+  g_variant_iter_init (&iter, xattrs);
+  while (g_variant_iter_loop (&iter, "(^&ay@ay)", &name, &value))
+    {
+      gsize value_len;
+      const guint8 *value_data = g_variant_get_fixed_array (value, &value_len, 1);
+
+      if (fsetxattr (fd, (const char *)name, value_data, value_len, 0) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          g_variant_unref (value);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Returns the path of a file object in a bare or bare-user repo, which
+   checked out files can be hardlinks to */
+static char *
+get_file_object_path (OstreeRepo *repo,
+                      const char *checksum)
+{
+  gs_free char *relpath = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+
+  return g_build_filename (gs_file_get_path_cached (ostree_repo_get_path (repo)),
+                           relpath, NULL);
+}
+
+/* ostree_repo_checkout_tree_at() only checks out directories, this
+   does the same for a single non-directory file object. Like the
+   checkout with no_copy_fallback unset, the file is copied whenever
+   it can't be hardlinked. */
+static gboolean
+checkout_file_at (XdgAppDir *self,
+                  OstreeRepo *repo,
+                  const char *checksum,
+                  int destination_dfd,
+                  const char *destination_name,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GInputStream *input = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GOutputStream *output = NULL;
+  gs_fd_close int fd = -1;
+  guint32 mode;
+
+  if (!ostree_repo_load_file (repo, checksum, &input, &file_info, &xattrs,
+                              cancellable, error))
+    goto out;
+
+  /* Hardlink the object when it has the right metadata, like ostree
+     does. Bare-user repos store symlinks as regular files, so only
+     regular files are linked. */
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR &&
+      ostree_repo_get_parent (repo) == NULL &&
+      ostree_repo_get_mode (repo) == (self->user ? OSTREE_REPO_MODE_BARE_USER : OSTREE_REPO_MODE_BARE))
+    {
+      gs_free char *object_path = get_file_object_path (repo, checksum);
+
+      if (linkat (AT_FDCWD, object_path, destination_dfd, destination_name, 0) == 0)
+        {
+          ret = TRUE;
+          goto out;
+        }
+
+      g_debug ("Can't hardlink %s, copying instead: %s", object_path, g_strerror (errno));
+    }
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      if (symlinkat (g_file_info_get_symlink_target (file_info),
+                     destination_dfd, destination_name) != 0 ||
+          (!self->user &&
+           fchownat (destination_dfd, destination_name,
+                     g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+                     g_file_info_get_attribute_uint32 (file_info, "unix::gid"),
+                     AT_SYMLINK_NOFOLLOW) != 0))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      ret = TRUE;
+      goto out;
+    }
+
+  fd = openat (destination_dfd, destination_name,
+               O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOCTTY, 0600);
+  if (fd == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  output = g_unix_output_stream_new (fd, FALSE);
+  if (g_output_stream_splice (output, input, 0, cancellable, error) < 0)
+    goto out;
+
+  mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  if (self->user)
+    mode &= ~(S_ISUID | S_ISGID);
+  else
+    {
+      if (fchown (fd,
+                  g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+                  g_file_info_get_attribute_uint32 (file_info, "unix::gid")) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (!set_xattrs (fd, xattrs, error))
+        goto out;
+    }
+
+  if (fchmod (fd, mode & 07777) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Directories of a commit down to this depth are created by the
+   thread walking the commit, everything below them is checked out
+   by the thread pool. With the usual files/ and files/share/ layout
+   this splits up wide trees like files/share/locale and files/lib. */
+#define CHECKOUT_SPLIT_DEPTH 3
+
+/* OstreeRepo is not safe to use from several threads at once, so
+   every thread takes an instance of its own while running a job */
+typedef struct {
+  OstreeRepo *repo;
+  GMutex lock;
+  GPtrArray *repos;
+} RepoPool;
+
+static void
+repo_pool_init (RepoPool *pool,
+                OstreeRepo *repo)
+{
+  pool->repo = repo;
+  pool->repos = g_ptr_array_new_with_free_func (g_object_unref);
+  g_mutex_init (&pool->lock);
+}
+
+static void
+repo_pool_clear (RepoPool *pool)
+{
+  g_ptr_array_unref (pool->repos);
+  g_mutex_clear (&pool->lock);
+}
+
+static OstreeRepo *
+repo_pool_get (RepoPool *pool,
+               GCancellable *cancellable,
+               GError **error)
+{
+  OstreeRepo *repo = NULL;
+
+  g_mutex_lock (&pool->lock);
+  if (pool->repos->len > 0)
+    repo = g_ptr_array_remove_index_fast (pool->repos, pool->repos->len - 1);
+  g_mutex_unlock (&pool->lock);
+
+  if (repo == NULL)
+    {
+      repo = ostree_repo_new (ostree_repo_get_path (pool->repo));
+      if (!ostree_repo_open (repo, cancellable, error))
+        g_clear_object (&repo);
+      else
+        ostree_repo_set_disable_fsync (repo, TRUE);
+    }
+
+  return repo;
+}
+
+static void
+repo_pool_release (RepoPool *pool,
+                   OstreeRepo *repo)
+{
+  g_mutex_lock (&pool->lock);
+  g_ptr_array_add (pool->repos, repo);
+  g_mutex_unlock (&pool->lock);
+}
+
+typedef struct {
+  char *path;
+  GFileInfo *info;
+  GVariant *xattrs;
+} CheckoutDir;
+
+typedef struct {
+  XdgAppDir *dir;
+  const OstreeRepoCheckoutOptions *options;
+  const char *checksum;
+  DeploySubset *subset;
+  GCancellable *cancellable;
+  GPtrArray *dirs;
+  guint n_jobs;
+
+  RepoPool repos;
+
+  GMutex lock;
+  GError *error;
+  guint error_index;
+} CheckoutContext;
+
+typedef struct {
+  CheckoutContext *context;
+  guint index;
+  char *destination;
+  /* Either a directory of the commit to check out as destination, or
+     files to check out into the destination directory */
+  char *subpath;
+  GPtrArray *names;
+  GPtrArray *checksums;
+} CheckoutJob;
+
+static void
+checkout_dir_free (CheckoutDir *dir)
+{
+  g_free (dir->path);
+  g_object_unref (dir->info);
+  if (dir->xattrs)
+    g_variant_unref (dir->xattrs);
+  g_free (dir);
+}
+
+static void
+checkout_job_free (CheckoutJob *job)
+{
+  g_free (job->destination);
+  g_free (job->subpath);
+  if (job->names)
+    g_ptr_array_unref (job->names);
+  if (job->checksums)
+    g_ptr_array_unref (job->checksums);
+  g_free (job);
+}
+
+/* Keeps the error of the first job in commit order, so that the error
+   reported doesn't depend on how the jobs were scheduled. Other jobs
+   get cancelled by the first error, so their cancellation errors are
+   only kept if there is nothing else. */
+static void
+checkout_context_set_error (CheckoutContext *context,
+                            guint index,
+                            GError *error)
+{
+  gboolean cancelled = g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  g_mutex_lock (&context->lock);
+  if (context->error == NULL ||
+      (g_error_matches (context->error, G_IO_ERROR, G_IO_ERROR_CANCELLED) && !cancelled) ||
+      (index < context->error_index &&
+       g_error_matches (context->error, G_IO_ERROR, G_IO_ERROR_CANCELLED) == cancelled))
+    {
+      g_clear_error (&context->error);
+      context->error = error;
+      context->error_index = index;
+      error = NULL;
+    }
+  g_mutex_unlock (&context->lock);
+
+  g_clear_error (&error);
+  g_cancellable_cancel (context->cancellable);
+}
+
+static gboolean
+run_checkout_job (CheckoutJob *job,
+                  OstreeRepo *repo,
+                  GError **error)
+{
+  CheckoutContext *context = job->context;
+  gs_fd_close int dfd = -1;
+  int i;
+
+  if (job->subpath)
+    {
+      OstreeRepoCheckoutOptions options = *context->options;
+
+      options.subpath = job->subpath;
+      return ostree_repo_checkout_tree_at (repo, &options, AT_FDCWD, job->destination,
+                                           context->checksum, context->cancellable, error);
+    }
+
+  if (!gs_file_open_dir_fd_at (AT_FDCWD, job->destination, &dfd,
+                               context->cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < job->names->len; i++)
+    {
+      if (!checkout_file_at (context->dir, repo,
+                             g_ptr_array_index (job->checksums, i),
+                             dfd, g_ptr_array_index (job->names, i),
+                             context->cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+checkout_job_thread (gpointer data,
+                     gpointer user_data)
+{
+  CheckoutJob *job = data;
+  CheckoutContext *context = user_data;
+  OstreeRepo *repo = NULL;
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (context->cancellable, &error))
+    goto out;
+
+  repo = repo_pool_get (&context->repos, context->cancellable, &error);
+  if (repo == NULL)
+    goto out;
+
+  if (!run_checkout_job (job, repo, &error))
+    goto out;
+
+ out:
+  if (repo)
+    repo_pool_release (&context->repos, repo);
+  if (error)
+    checkout_context_set_error (context, job->index, error);
+  checkout_job_free (job);
+}
+
+static void
+queue_checkout_job (CheckoutContext *context,
+                    GThreadPool *pool,
+                    CheckoutJob *job)
+{
+  job->context = context;
+  job->index = context->n_jobs++;
+  g_thread_pool_push (pool, job, NULL);
+}
+
+/* Creates destination for the commit directory source, and queues
+   jobs for what is below it */
+static gboolean
+queue_checkout_dir (CheckoutContext *context,
+                    GThreadPool *pool,
+                    GFile *source,
+                    GFileInfo *source_info,
+                    const char *destination,
+                    int depth,
+                    GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  GFileInfo *child_info = NULL;
+  GError *temp_error = NULL;
+  CheckoutJob *files_job = NULL;
+  CheckoutDir *dir;
+
+  if (mkdir (destination, 0700) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  dir = g_new0 (CheckoutDir, 1);
+  dir->path = g_strdup (destination);
+  dir->info = g_object_ref (source_info);
+  g_ptr_array_add (context->dirs, dir);
+
+  if (!context->dir->user &&
+      !ostree_repo_file_get_xattrs (OSTREE_REPO_FILE (source), &dir->xattrs,
+                                    context->cancellable, error))
+    goto out;
+
+  dir_enum = g_file_enumerate_children (source, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        context->cancellable,
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, context->cancellable, &temp_error)) != NULL)
+    {
+      const char *name = g_file_info_get_name (child_info);
+      gs_unref_object GFile *child = g_file_get_child (source, name);
+      gs_free char *child_destination = g_build_filename (destination, name, NULL);
+      SubsetMatch match;
+
+      match = deploy_subset_match (context->subset, context->dir->repo, child, child_info);
+      if (match == SUBSET_MATCH_NONE)
+        {
+          g_clear_object (&child_info);
+          continue;
+        }
+
+      if (g_file_info_get_file_type (child_info) != G_FILE_TYPE_DIRECTORY)
+        {
+          if (files_job == NULL)
+            {
+              files_job = g_new0 (CheckoutJob, 1);
+              files_job->destination = g_strdup (destination);
+              files_job->names = g_ptr_array_new_with_free_func (g_free);
+              files_job->checksums = g_ptr_array_new_with_free_func (g_free);
+            }
+
+          g_ptr_array_add (files_job->names, g_strdup (name));
+          g_ptr_array_add (files_job->checksums,
+                           g_strdup (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child))));
+        }
+      else if (depth < CHECKOUT_SPLIT_DEPTH || match == SUBSET_MATCH_PARTIAL)
+        {
+          if (!queue_checkout_dir (context, pool, child, child_info, child_destination,
+                                   depth + 1, error))
+            goto out;
+        }
+      else
+        {
+          CheckoutJob *job = g_new0 (CheckoutJob, 1);
+
+          job->destination = child_destination;
+          child_destination = NULL;
+          job->subpath = g_file_get_path (child);
+          queue_checkout_job (context, pool, job);
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (files_job)
+    {
+      queue_checkout_job (context, pool, files_job);
+      files_job = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  g_clear_object (&child_info);
+  if (files_job)
+    checkout_job_free (files_job);
+  return ret;
+}
+
+/* Gives the directories created by queue_checkout_dir() their final
+   metadata, deepest first as the permissions may not allow adding
+   anything to them anymore. */
+static gboolean
+finish_checkout_dirs (CheckoutContext *context,
+                      GError **error)
+{
+  int i;
+
+  for (i = context->dirs->len - 1; i >= 0; i--)
+    {
+      CheckoutDir *dir = g_ptr_array_index (context->dirs, i);
+      gs_fd_close int dfd = -1;
+
+      if (!gs_file_open_dir_fd_at (AT_FDCWD, dir->path, &dfd, NULL, error))
+        return FALSE;
+
+      if (!context->dir->user)
+        {
+          if (fchown (dfd,
+                      g_file_info_get_attribute_uint32 (dir->info, "unix::uid"),
+                      g_file_info_get_attribute_uint32 (dir->info, "unix::gid")) != 0)
+            {
+              gs_set_error_from_errno (error, errno);
+              return FALSE;
+            }
+
+          if (dir->xattrs && !set_xattrs (dfd, dir->xattrs, error))
+            return FALSE;
+        }
+
+      if (fchmod (dfd, g_file_info_get_attribute_uint32 (dir->info, "unix::mode") & 07777) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+cancel_checkout (GCancellable *cancellable,
+                 GCancellable *checkout_cancellable)
+{
+  g_cancellable_cancel (checkout_cancellable);
+}
+
+/* Checks out commit into destination like ostree_repo_checkout_tree_at()
+   does, but splits the tree up and checks out the parts on a thread pool.
+   The number of threads can be set with XDG_APP_CHECKOUT_THREADS, e.g.
+   to 1 for rotating disks, where seeking between trees costs more than
+   it gains. Only what is in subset is checked out, unless it is NULL. */
+static gboolean
+checkout_tree (XdgAppDir *self,
+               OstreeRepoCheckoutOptions *options,
+               const char *checksum,
+               DeploySubset *subset,
+               const char *destination,
+               GCancellable *cancellable,
+               GError **error)
+{
+  gboolean ret = FALSE;
+  int n_threads = get_checkout_threads ();
+  CheckoutContext context = { 0, };
+  OstreeRepoCheckoutOptions job_options;
+  gs_unref_object GFile *root = NULL;
+  gs_unref_object GFileInfo *root_info = NULL;
+  gs_unref_object GCancellable *checkout_cancellable = NULL;
+  GThreadPool *pool = NULL;
+  GError *temp_error = NULL;
+  gulong cancelled_id = 0;
+  gint64 start_time;
+
+  if (n_threads <= 1 && subset == NULL)
+    return ostree_repo_checkout_tree_at (self->repo, options, AT_FDCWD, destination,
+                                         checksum, cancellable, error);
+
+  start_time = g_get_monotonic_time ();
+
+  context.dir = self;
+  context.checksum = checksum;
+  context.subset = subset;
+  context.dirs = g_ptr_array_new_with_free_func ((GDestroyNotify)checkout_dir_free);
+  repo_pool_init (&context.repos, self->repo);
+  g_mutex_init (&context.lock);
+
+  if (!ostree_repo_read_commit (self->repo, checksum, &root, NULL, cancellable, error))
+    goto out;
+
+  if (options->subpath != NULL && strcmp (options->subpath, "/") != 0)
+    {
+      GFile *subdir = g_file_resolve_relative_path (root, options->subpath + 1);
+
+      g_object_unref (root);
+      root = subdir;
+    }
+
+  root_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
+                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                 cancellable, error);
+  if (root_info == NULL)
+    goto out;
+
+  /* The devino cache is filled in by the checkout and can't be shared
+     between threads */
+  job_options = *options;
+  job_options.devino_to_csum_cache = NULL;
+
+  checkout_cancellable = g_cancellable_new ();
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_checkout),
+                                          checkout_cancellable, NULL);
+
+  context.options = &job_options;
+  context.cancellable = checkout_cancellable;
+
+  pool = g_thread_pool_new (checkout_job_thread, &context, n_threads, FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  /* A failure of the walk counts as the failure of the job it would
+     have queued next */
+  if (!queue_checkout_dir (&context, pool, root, root_info, destination, 1, &temp_error))
+    checkout_context_set_error (&context, context.n_jobs, temp_error);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  pool = NULL;
+
+  if (context.error)
+    {
+      /* Report the cancellation of the caller rather than ours */
+      if (g_error_matches (context.error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_clear_error (&context.error);
+          if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+          goto out;
+        }
+
+      g_propagate_error (error, context.error);
+      context.error = NULL;
+      goto out;
+    }
+
+  if (!finish_checkout_dirs (&context, error))
+    goto out;
+
+  g_debug ("Checked out %s with %d threads in %d jobs in %.3f s", checksum,
+           n_threads, context.n_jobs,
+           (g_get_monotonic_time () - start_time) / (double)G_USEC_PER_SEC);
+
+  ret = TRUE;
+ out:
+  if (pool)
+    g_thread_pool_free (pool, TRUE, TRUE);
+  if (cancelled_id)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+  g_ptr_array_unref (context.dirs);
+  repo_pool_clear (&context.repos);
+  g_clear_error (&context.error);
+  g_mutex_clear (&context.lock);
+  return ret;
+}
+
+/* Checks out commit with the fd based checkout API. Files are
+   hardlinked from the repo where its mode allows, and then a failure to
+   hardlink is an error, e.g. because the filesystem ran out of links,
+   in which case we check out again with copies. The devino cache of
+   self is shared by all checkouts, so ostree can reuse the checksums of
+   the files it links. */
+static gboolean
+checkout_commit (XdgAppDir *self,
+                 const char *checksum,
+                 DeploySubset *subset,
+                 GFile *checkoutdir,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+  OstreeRepoCheckoutOptions options = { 0, };
+  OstreeRepoMode mode;
+  GError *temp_error = NULL;
+
+  if (self->devino_cache == NULL)
+    self->devino_cache = ostree_repo_devino_cache_new ();
+
+  options.mode = self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+  options.devino_to_csum_cache = self->devino_cache;
+
+  /* Objects in the parent repo are never hardlinked */
+  mode = ostree_repo_get_mode (self->repo);
+  if (ostree_repo_get_parent (self->repo) == NULL &&
+      mode == (self->user ? OSTREE_REPO_MODE_BARE_USER : OSTREE_REPO_MODE_BARE))
+    {
+      options.no_copy_fallback = TRUE;
+
+      if (checkout_tree (self, &options, checksum, subset,
+                         gs_file_get_path_cached (checkoutdir),
+                         cancellable, &temp_error))
+        return TRUE;
+
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, temp_error);
+          return FALSE;
+        }
+
+      g_debug ("Can't hardlink %s, copying instead: %s", checksum, temp_error->message);
+      g_clear_error (&temp_error);
+
+      if (!gs_shutil_rm_rf (checkoutdir, cancellable, error))
+        return FALSE;
+
+      options.no_copy_fallback = FALSE;
+    }
+
+  return checkout_tree (self, &options, checksum, subset,
+                        gs_file_get_path_cached (checkoutdir),
+                        cancellable, error);
+}
+
+/* Files are verified in batches of about this many bytes, so the large
+   files of a directory are spread over the threads */
+#define VERIFY_BATCH_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+  char *path;
+  /* NULL for a directory, which gets checked out again as a whole */
+  char *checksum;
+  /* The file is a hardlink to its object in the repo, which is then
+     damaged too and can't be used for repairing it */
+  gboolean bad_object;
+} VerifyDamage;
+
+typedef struct {
+  char *name;
+  char *checksum;
+  GFileType type;
+  guint64 size;
+} VerifyFile;
+
+typedef struct {
+  XdgAppDir *dir;
+  XdgAppDirRepairFlags flags;
+  DeploySubset *subset;
+  const char *checkoutpath;
+  /* The files are in a read-only image, and not verified */
+  gboolean image;
+  time_t deploy_time;
+  GCancellable *cancellable;
+  RepoPool repos;
+
+  GMutex lock;
+  GPtrArray *damaged;
+  guint n_files;
+  guint n_linked;
+  GError *error;
+} VerifyContext;
+
+typedef struct {
+  VerifyContext *context;
+  char *path;
+  GPtrArray *files;
+  guint64 size;
+} VerifyJob;
+
+static void
+verify_damage_free (VerifyDamage *damage)
+{
+  g_free (damage->path);
+  g_free (damage->checksum);
+  g_free (damage);
+}
+
+static void
+verify_file_free (VerifyFile *file)
+{
+  g_free (file->name);
+  g_free (file->checksum);
+  g_free (file);
+}
+
+static void
+verify_job_free (VerifyJob *job)
+{
+  g_free (job->path);
+  g_ptr_array_unref (job->files);
+  g_free (job);
+}
+
+static void
+verify_context_add_damage (VerifyContext *context,
+                           const char *path,
+                           const char *checksum,
+                           gboolean bad_object)
+{
+  VerifyDamage *damage = g_new0 (VerifyDamage, 1);
+
+  damage->path = g_strdup (path);
+  damage->checksum = g_strdup (checksum);
+  damage->bad_object = bad_object;
+
+  g_mutex_lock (&context->lock);
+  g_ptr_array_add (context->damaged, damage);
+  g_mutex_unlock (&context->lock);
+}
+
+static gboolean
+same_file_as_object (OstreeRepo *repo,
+                     const char *checksum,
+                     struct stat *stbuf)
+{
+  gs_free char *object_path = get_file_object_path (repo, checksum);
+  struct stat object_stbuf;
+
+  return lstat (object_path, &object_stbuf) == 0 &&
+    object_stbuf.st_dev == stbuf->st_dev &&
+    object_stbuf.st_ino == stbuf->st_ino;
+}
+
+/* Checks the content of the checked out file name against the object
+   checksum. The metadata of the object is used rather than the one of
+   the file, which differs in user checkouts. */
+static gboolean
+verify_file_content (OstreeRepo *repo,
+                     int dfd,
+                     const char *name,
+                     const char *checksum,
+                     gboolean *out_valid,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GInputStream *input = NULL;
+  gs_free guchar *csum = NULL;
+  gs_free char *actual_checksum = NULL;
+  int fd;
+
+  if (!ostree_repo_load_file (repo, checksum, NULL, &file_info, &xattrs,
+                              cancellable, error))
+    goto out;
+
+  fd = openat (dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  input = g_unix_input_stream_new (fd, TRUE);
+  if (!ostree_checksum_file_from_input (file_info, xattrs, input,
+                                        OSTREE_OBJECT_TYPE_FILE, &csum,
+                                        cancellable, error))
+    goto out;
+
+  actual_checksum = ostree_checksum_from_bytes (csum);
+  *out_valid = strcmp (actual_checksum, checksum) == 0;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+verify_file (VerifyContext *context,
+             OstreeRepo *repo,
+             int dfd,
+             const char *path,
+             VerifyFile *file,
+             GError **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *file_path = g_build_filename (path, file->name, NULL);
+  gboolean valid;
+  struct stat stbuf;
+
+  if (fstatat (dfd, file->name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      verify_context_add_damage (context, file_path, file->checksum, FALSE);
+      ret = TRUE;
+      goto out;
+    }
+
+  if (file->type == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      gs_unref_object GFileInfo *file_info = NULL;
+      char target[PATH_MAX + 1];
+      ssize_t len;
+
+      valid = FALSE;
+      if (S_ISLNK (stbuf.st_mode))
+        {
+          if (!ostree_repo_load_file (repo, file->checksum, NULL, &file_info, NULL,
+                                      context->cancellable, error))
+            goto out;
+
+          len = readlinkat (dfd, file->name, target, sizeof (target) - 1);
+          if (len == -1)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+          target[len] = 0;
+
+          valid = strcmp (target, g_file_info_get_symlink_target (file_info)) == 0;
+        }
+    }
+  else if (!S_ISREG (stbuf.st_mode) || stbuf.st_size != file->size)
+    valid = FALSE;
+  else if (context->flags & XDG_APP_DIR_REPAIR_FLAGS_FAST)
+    {
+      /* Always compared, so the number of hardlinked files shows
+         whether linking to the objects works */
+      gboolean linked = same_file_as_object (repo, file->checksum, &stbuf);
+
+      if (linked)
+        g_atomic_int_inc (&context->n_linked);
+      valid = linked || stbuf.st_mtime <= context->deploy_time;
+    }
+  else if (!verify_file_content (repo, dfd, file->name, file->checksum, &valid,
+                                 context->cancellable, error))
+    goto out;
+
+  if (!valid)
+    verify_context_add_damage (context, file_path, file->checksum,
+                               file->type != G_FILE_TYPE_SYMBOLIC_LINK &&
+                               same_file_as_object (repo, file->checksum, &stbuf));
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+verify_job_thread (gpointer data,
+                   gpointer user_data)
+{
+  VerifyJob *job = data;
+  VerifyContext *context = user_data;
+  OstreeRepo *repo = NULL;
+  gs_free char *dir_path = NULL;
+  gs_fd_close int dfd = -1;
+  GError *error = NULL;
+  int i;
+
+  if (g_cancellable_set_error_if_cancelled (context->cancellable, &error))
+    goto out;
+
+  repo = repo_pool_get (&context->repos, context->cancellable, &error);
+  if (repo == NULL)
+    goto out;
+
+  dir_path = g_build_filename (context->checkoutpath, job->path, NULL);
+  if (!gs_file_open_dir_fd_at (AT_FDCWD, dir_path, &dfd, context->cancellable, &error))
+    goto out;
+
+  for (i = 0; i < job->files->len; i++)
+    {
+      if (!verify_file (context, repo, dfd, job->path,
+                        g_ptr_array_index (job->files, i), &error))
+        goto out;
+    }
+
+  g_mutex_lock (&context->lock);
+  context->n_files += job->files->len;
+  g_mutex_unlock (&context->lock);
+
+ out:
+  if (repo)
+    repo_pool_release (&context->repos, repo);
+  if (error)
+    {
+      g_mutex_lock (&context->lock);
+      if (context->error == NULL)
+        {
+          context->error = error;
+          error = NULL;
+        }
+      g_mutex_unlock (&context->lock);
+      g_clear_error (&error);
+      g_cancellable_cancel (context->cancellable);
+    }
+  verify_job_free (job);
+}
+
+static void
+queue_verify_job (VerifyContext *context,
+                  GThreadPool *pool,
+                  VerifyJob **job)
+{
+  (*job)->context = context;
+  g_thread_pool_push (pool, *job, NULL);
+  *job = NULL;
+}
+
+/* Walks the commit directory source, checking that the directories
+   exist in the checkout and queueing the files in them for
+   verification */
+static gboolean
+queue_verify_dir (VerifyContext *context,
+                  GThreadPool *pool,
+                  GFile *source,
+                  const char *path,
+                  GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  GFileInfo *child_info = NULL;
+  GError *temp_error = NULL;
+  VerifyJob *job = NULL;
+
+  dir_enum = g_file_enumerate_children (source, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        context->cancellable,
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, context->cancellable, &temp_error)) != NULL)
+    {
+      const char *name = g_file_info_get_name (child_info);
+      gs_unref_object GFile *child = g_file_get_child (source, name);
+      gs_free char *child_path = g_build_filename (path, name, NULL);
+
+      /* Exported desktop and service files are rewritten when
+         deploying, so they never match the commit */
+      if ((context->image && strcmp (child_path, "files") == 0) ||
+          (g_str_has_prefix (child_path, "export/") &&
+           (g_str_has_suffix (name, ".desktop") || g_str_has_suffix (name, ".service"))) ||
+          deploy_subset_match (context->subset, context->dir->repo,
+                               child, child_info) == SUBSET_MATCH_NONE)
+        {
+          g_clear_object (&child_info);
+          continue;
+        }
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          gs_free char *checkout_path = g_build_filename (context->checkoutpath, child_path, NULL);
+          struct stat stbuf;
+
+          if (lstat (checkout_path, &stbuf) != 0 || !S_ISDIR (stbuf.st_mode))
+            verify_context_add_damage (context, child_path, NULL, FALSE);
+          else if (!queue_verify_dir (context, pool, child, child_path, error))
+            goto out;
+        }
+      else
+        {
+          VerifyFile *file = g_new0 (VerifyFile, 1);
+
+          file->name = g_strdup (name);
+          file->checksum = g_strdup (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child)));
+          file->type = g_file_info_get_file_type (child_info);
+          file->size = g_file_info_get_size (child_info);
+
+          if (job == NULL)
+            {
+              job = g_new0 (VerifyJob, 1);
+              job->path = g_strdup (path);
+              job->files = g_ptr_array_new_with_free_func ((GDestroyNotify)verify_file_free);
+            }
+
+          g_ptr_array_add (job->files, file);
+          job->size += file->size;
+
+          if (job->size >= VERIFY_BATCH_SIZE)
+            queue_verify_job (context, pool, &job);
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (job)
+    queue_verify_job (context, pool, &job);
+
+  ret = TRUE;
+ out:
+  g_clear_object (&child_info);
+  if (job)
+    verify_job_free (job);
+  return ret;
+}
+
+static gint
+compare_damage (gconstpointer a,
+                gconstpointer b)
+{
+  const VerifyDamage *damage_a = *(const VerifyDamage **)a;
+  const VerifyDamage *damage_b = *(const VerifyDamage **)b;
+
+  return strcmp (damage_a->path, damage_b->path);
+}
+
+static gboolean
+repair_damage (XdgAppDir *self,
+               const char *checksum,
+               DeploySubset *subset,
+               const char *checkoutpath,
+               VerifyDamage *damage,
+               GCancellable *cancellable,
+               GError **error)
+{
+  gs_free char *path = g_build_filename (checkoutpath, damage->path, NULL);
+  gs_unref_object GFile *file = g_file_new_for_path (path);
+
+  if (!gs_shutil_rm_rf (file, cancellable, error))
+    return FALSE;
+
+  if (damage->checksum == NULL)
+    {
+      gs_free char *subpath = g_strconcat ("/", damage->path, NULL);
+      OstreeRepoCheckoutOptions options = { 0, };
+
+      if (subset == NULL)
+        return checkout_subpath (self, checksum, subpath, path, cancellable, error);
+
+      options.mode = self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE;
+      options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+      options.subpath = subpath;
+
+      return checkout_tree (self, &options, checksum, subset, path, cancellable, error);
+    }
+
+  return checkout_file_at (self, self->repo, damage->checksum, AT_FDCWD, path,
+                           cancellable, error);
+}
+
+/* Verifies the files of the deployment of checksum against the commit,
+   using a thread pool as for checkouts. Damaged or missing files are
+   checked out again unless XDG_APP_DIR_REPAIR_FLAGS_DRY_RUN is given,
+   and returned in out_damaged. Files that are only in the deployment,
+   or not in the subset of ref, are ignored, and so are the files of
+   deployments made as images. */
+gboolean
+xdg_app_dir_repair_deployment (XdgAppDir *self,
+                               const char *ref,
+                               const char *checksum,
+                               XdgAppDirRepairFlags flags,
+                               guint *out_n_files,
+                               char ***out_damaged,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+  gboolean ret = FALSE;
+  VerifyContext context = { 0, };
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *checkoutdir = NULL;
+  gs_unref_object GFile *image = NULL;
+  gs_unref_object GFile *root = NULL;
+  gs_unref_object GCancellable *verify_cancellable = NULL;
+  gs_unref_ptrarray GPtrArray *damaged = NULL;
+  gs_free char *deploy_data_path = NULL;
+  GThreadPool *pool = NULL;
+  GError *temp_error = NULL;
+  gulong cancelled_id = 0;
+  guint n_bad_objects = 0;
+  struct stat stbuf;
+  int i;
+
+  context.dir = self;
+  context.flags = flags;
+  context.damaged = g_ptr_array_new_with_free_func ((GDestroyNotify)verify_damage_free);
+  repo_pool_init (&context.repos, self->repo);
+  g_mutex_init (&context.lock);
+
+  if (!load_deploy_subset (self, ref, &context.subset, error))
+    goto out;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  checkoutdir = g_file_get_child (deploy_base, checksum);
+  context.checkoutpath = gs_file_get_path_cached (checkoutdir);
+
+  /* Files changed after deploying are newer than the deploy data,
+     which is written last */
+  deploy_data_path = g_build_filename (context.checkoutpath, "deploy", NULL);
+  if (stat (deploy_data_path, &stbuf) != 0 &&
+      stat (context.checkoutpath, &stbuf) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+  context.deploy_time = stbuf.st_mtime;
+
+  image = g_file_get_child (checkoutdir, XDG_APP_DEPLOY_IMAGE);
+  context.image = g_file_query_exists (image, cancellable);
+
+  if (!ostree_repo_read_commit (self->repo, checksum, &root, NULL, cancellable, error))
+    goto out;
+
+  verify_cancellable = g_cancellable_new ();
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_checkout),
+                                          verify_cancellable, NULL);
+  context.cancellable = verify_cancellable;
+
+  pool = g_thread_pool_new (verify_job_thread, &context, get_checkout_threads (), FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  if (!queue_verify_dir (&context, pool, root, "", &temp_error))
+    {
+      g_mutex_lock (&context.lock);
+      if (context.error == NULL)
+        context.error = temp_error;
+      else
+        g_error_free (temp_error);
+      g_mutex_unlock (&context.lock);
+      g_cancellable_cancel (verify_cancellable);
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  pool = NULL;
+
+  if (context.error)
+    {
+      if (g_error_matches (context.error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+          g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_propagate_error (error, context.error);
+      context.error = NULL;
+      goto out;
+    }
+
+  g_debug ("Verified %u files of %s, %u of them hardlinks to their objects",
+           context.n_files, checksum, context.n_linked);
+
+  /* A checkout from a parentless repo of the right mode hardlinks all
+     regular files, unless they are on another filesystem */
+  if ((flags & XDG_APP_DIR_REPAIR_FLAGS_FAST) && !context.image &&
+      context.n_files > 0 && context.n_linked == 0 &&
+      ostree_repo_get_parent (self->repo) == NULL &&
+      ostree_repo_get_mode (self->repo) == (self->user ? OSTREE_REPO_MODE_BARE_USER : OSTREE_REPO_MODE_BARE))
+    g_debug ("No file of %s is a hardlink to its object, all were copied", checksum);
+
+  g_ptr_array_sort (context.damaged, compare_damage);
+
+  damaged = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < context.damaged->len; i++)
+    {
+      VerifyDamage *damage = g_ptr_array_index (context.damaged, i);
+
+      g_ptr_array_add (damaged, g_strdup (damage->path));
+
+      if (flags & XDG_APP_DIR_REPAIR_FLAGS_DRY_RUN)
+        continue;
+
+      if (damage->bad_object)
+        {
+          n_bad_objects++;
+          continue;
+        }
+
+      if (!repair_damage (self, checksum, context.subset, context.checkoutpath, damage,
+                          cancellable, error))
+        {
+          g_prefix_error (error, "While repairing %s: ", damage->path);
+          goto out;
+        }
     }
+  g_ptr_array_add (damaged, NULL);
 
-  buf[bytes_read] = '\0';
+  if (n_bad_objects > 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "%u damaged files of %s are damaged in the repository too, reinstall it to repair them",
+                   n_bad_objects, ref);
+      goto out;
+    }
 
-  if (length)
-    *length = bytes_read;
+  if (out_n_files)
+    *out_n_files = context.n_files;
+  if (out_damaged)
+    {
+      *out_damaged = (char **)g_ptr_array_free (damaged, FALSE);
+      damaged = NULL;
+    }
 
-  *contents = buf;
+  ret = TRUE;
+ out:
+  if (pool)
+    g_thread_pool_free (pool, TRUE, TRUE);
+  if (cancelled_id)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+  g_ptr_array_unref (context.damaged);
+  deploy_subset_free (context.subset);
+  repo_pool_clear (&context.repos);
+  g_clear_error (&context.error);
+  g_mutex_clear (&context.lock);
+  return ret;
+}
 
-  return TRUE;
+static gboolean
+xattrs_contain (GVariant *xattrs,
+                const char *name)
+{
+  GVariantIter iter;
+  const char *other;
+
+  g_variant_iter_init (&iter, xattrs);
+  while (g_variant_iter_next (&iter, "(^&ay@ay)", &other, NULL))
+    {
+      if (strcmp (name, other) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
 }
 
+/* Changes the metadata of the directory at path from the dirmeta
+   object from_meta to the one to_meta, like a checkout would have
+   created it. User installations only get the mode. */
 static gboolean
-export_desktop_file (const char    *app,
-                     const char    *branch,
-                     const char    *arch,
-                     int            parent_fd,
-                     const char    *name,
-                     struct stat   *stat_buf,
-                     char         **target,
-                     GCancellable  *cancellable,
-                     GError       **error)
+apply_dirmeta (XdgAppDir *self,
+               const char *path,
+               const char *from_meta,
+               const char *to_meta,
+               GError **error)
 {
-  gboolean ret = FALSE;
-  gs_fd_close int desktop_fd = -1;
-  gs_free char *tmpfile_name = NULL;
-  gs_unref_object GOutputStream *out_stream = NULL;
-  gs_free gchar *data = NULL;
-  gsize data_len;
-  gs_free gchar *new_data = NULL;
-  gsize new_data_len;
-  gs_unref_keyfile GKeyFile *keyfile = NULL;
-  gs_free gchar *old_exec = NULL;
-  gint old_argc;
-  gs_strfreev gchar **old_argv = NULL;
-  gs_strfreev gchar **groups = NULL;
-  GString *new_exec = NULL;
-  gs_free char *escaped_app = g_shell_quote (app);
-  int i;
+  gs_unref_variant GVariant *from_v = NULL;
+  gs_unref_variant GVariant *to_v = NULL;
+  gs_unref_variant GVariant *from_xattrs = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_fd_close int dfd = -1;
+  guint32 uid, gid, mode;
 
-  if (!gs_file_openat_noatime (parent_fd, name, &desktop_fd, cancellable, error))
-    goto out;
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_META, from_meta, &from_v, error) ||
+      !ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_META, to_meta, &to_v, error))
+    return FALSE;
 
-  if (!read_fd (desktop_fd, stat_buf, &data, &data_len, error))
-    goto out;
+  g_variant_get (from_v, "(uuu@a(ayay))", NULL, NULL, NULL, &from_xattrs);
+  g_variant_get (to_v, "(uuu@a(ayay))", &uid, &gid, &mode, &xattrs);
 
-  keyfile = g_key_file_new ();
-  if (!g_key_file_load_from_data (keyfile, data, data_len, G_KEY_FILE_KEEP_TRANSLATIONS, error))
-    goto out;
+  if (!gs_file_open_dir_fd_at (AT_FDCWD, path, &dfd, NULL, error))
+    return FALSE;
 
-  if (g_str_has_suffix (name, ".service"))
+  if (!self->user)
     {
-      gs_free gchar *dbus_name = NULL;
-      gs_free gchar *expected_dbus_name = g_strndup (name, strlen (name) - strlen (".service"));
-
-      dbus_name = g_key_file_get_string (keyfile, "D-BUS Service", "Name", NULL);
+      GVariantIter iter;
+      const char *name;
 
-      if (dbus_name == NULL || strcmp (dbus_name, expected_dbus_name) != 0)
+      if (fchown (dfd, GUINT32_FROM_BE (uid), GUINT32_FROM_BE (gid)) != 0)
         {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "dbus service file %s has wrong name", name);
+          gs_set_error_from_errno (error, errno);
           return FALSE;
         }
-    }
 
-  groups = g_key_file_get_groups (keyfile, NULL);
+      g_variant_iter_init (&iter, from_xattrs);
+      while (g_variant_iter_next (&iter, "(^&ay@ay)", &name, NULL))
+        {
+          if (!xattrs_contain (xattrs, name) &&
+              fremovexattr (dfd, name) != 0 && errno != ENODATA)
+            {
+              gs_set_error_from_errno (error, errno);
+              return FALSE;
+            }
+        }
+
+      if (!set_xattrs (dfd, xattrs, error))
+        return FALSE;
+    }
 
-  for (i = 0; groups[i] != NULL; i++)
+  if (fchmod (dfd, GUINT32_FROM_BE (mode) & 07777) != 0)
     {
-      g_key_file_remove_key (keyfile, groups[i], "TryExec", NULL);
+      gs_set_error_from_errno (error, errno);
+      return FALSE;
+    }
 
-      /* Remove this to make sure nothing tries to execute it outside the sandbox*/
-      g_key_file_remove_key (keyfile, groups[i], "X-GNOME-Bugzilla-ExtraInfoScript", NULL);
+  return TRUE;
+}
 
-      new_exec = g_string_new ("");
-      g_string_append_printf (new_exec, XDG_APP_BINDIR"/xdg-app run --branch='%s' --arch='%s'", branch, arch);
+/* Updates the metadata of the directory at path and everything below
+   it from the dirtree and dirmeta objects of one commit to those of
+   another. ostree_diff_dirs() only reports files, so this picks up
+   directories whose mode, owner or xattrs changed. Subdirectories that
+   are the same in both are skipped, and ones that were added have been
+   checked out in full. Like in a checkout, the deepest directories are
+   done first. */
+static gboolean
+update_dirmeta (XdgAppDir *self,
+                const char *path,
+                const char *from_tree,
+                const char *from_meta,
+                const char *to_tree,
+                const char *to_meta,
+                GCancellable *cancellable,
+                GError **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
 
-      old_exec = g_key_file_get_string (keyfile, groups[i], "Exec", NULL);
-      if (old_exec && g_shell_parse_argv (old_exec, &old_argc, &old_argv, NULL) && old_argc >= 1)
+  if (strcmp (from_tree, to_tree) != 0)
+    {
+      gs_unref_variant GVariant *from_v = NULL;
+      gs_unref_variant GVariant *to_v = NULL;
+      gs_unref_variant GVariant *from_dirs = NULL;
+      gs_unref_variant GVariant *to_dirs = NULL;
+      gsize i, j, n_from, n_to;
+
+      if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE, from_tree, &from_v, error) ||
+          !ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE, to_tree, &to_v, error))
+        return FALSE;
+
+      from_dirs = g_variant_get_child_value (from_v, 1);
+      to_dirs = g_variant_get_child_value (to_v, 1);
+      n_from = g_variant_n_children (from_dirs);
+      n_to = g_variant_n_children (to_dirs);
+
+      /* Both lists are sorted by name */
+      for (i = 0, j = 0; i < n_to && j < n_from; )
         {
-          int i;
-          gs_free char *command = g_shell_quote (old_argv[0]);
-
-          g_string_append_printf (new_exec, " --command=%s", command);
-
-          g_string_append (new_exec, " ");
-          g_string_append (new_exec, escaped_app);
-
-          for (i = 1; i < old_argc; i++)
+          const char *name;
+          const char *from_name;
+          gs_unref_variant GVariant *to_tree_v = NULL;
+          gs_unref_variant GVariant *to_meta_v = NULL;
+          gs_unref_variant GVariant *from_tree_v = NULL;
+          gs_unref_variant GVariant *from_meta_v = NULL;
+          gs_free char *child_path = NULL;
+          gs_free char *child_from_tree = NULL;
+          gs_free char *child_from_meta = NULL;
+          gs_free char *child_to_tree = NULL;
+          gs_free char *child_to_meta = NULL;
+          int cmp;
+
+          g_variant_get_child (to_dirs, i, "(&s@ay@ay)", &name, &to_tree_v, &to_meta_v);
+          g_variant_get_child (from_dirs, j, "(&s@ay@ay)", &from_name, &from_tree_v, &from_meta_v);
+
+          cmp = strcmp (from_name, name);
+          if (cmp < 0)
             {
-              gs_free char *arg = g_shell_quote (old_argv[i]);
-              g_string_append (new_exec, " ");
-              g_string_append (new_exec, arg);
+              j++;
+              continue;
+            }
+          if (cmp > 0)
+            {
+              i++;
+              continue;
             }
-        }
-      else
-        {
-          g_string_append (new_exec, " ");
-          g_string_append (new_exec, escaped_app);
-        }
-
-      g_key_file_set_string (keyfile, groups[i], G_KEY_FILE_DESKTOP_KEY_EXEC, new_exec->str);
-    }
-
-  new_data = g_key_file_to_data (keyfile, &new_data_len, error);
-  if (new_data == NULL)
-    goto out;
 
-  if (!gs_file_open_in_tmpdir_at (parent_fd, 0755, &tmpfile_name, &out_stream, cancellable, error))
-    goto out;
+          i++;
+          j++;
 
-  if (!g_output_stream_write_all (out_stream, new_data, new_data_len, NULL, cancellable, error))
-    goto out;
+          child_path = g_build_filename (path, name, NULL);
+          child_from_tree = ostree_checksum_from_bytes_v (from_tree_v);
+          child_from_meta = ostree_checksum_from_bytes_v (from_meta_v);
+          child_to_tree = ostree_checksum_from_bytes_v (to_tree_v);
+          child_to_meta = ostree_checksum_from_bytes_v (to_meta_v);
 
-  if (!g_output_stream_close (out_stream, cancellable, error))
-    goto out;
+          if (!update_dirmeta (self, child_path,
+                               child_from_tree, child_from_meta,
+                               child_to_tree, child_to_meta,
+                               cancellable, error))
+            return FALSE;
+        }
+    }
 
-  gs_transfer_out_value (target, &tmpfile_name);
+  if (strcmp (from_meta, to_meta) != 0)
+    {
+      g_debug ("Updating metadata of directory %s", path);
+      if (!apply_dirmeta (self, path, from_meta, to_meta, error))
+        return FALSE;
+    }
 
-  ret = TRUE;
- out:
+  return TRUE;
+}
 
-  if (new_exec != NULL)
-    g_string_free (new_exec, TRUE);
+/* Returns the checksums of the root dirtree and dirmeta of commit */
+static void
+get_commit_root (GVariant *commit,
+                 char **out_tree,
+                 char **out_meta)
+{
+  gs_unref_variant GVariant *tree_v = NULL;
+  gs_unref_variant GVariant *meta_v = NULL;
 
-  return ret;
+  tree_v = g_variant_get_child_value (commit, 6);
+  meta_v = g_variant_get_child_value (commit, 7);
+  *out_tree = ostree_checksum_from_bytes_v (tree_v);
+  *out_meta = ostree_checksum_from_bytes_v (meta_v);
 }
 
+/* Deploys checksum by cloning the deployment of from_checksum with
+   hardlinks and then checking out only what changed between the two
+   commits, so the cost depends on the size of the update rather than
+   the size of the tree. */
 static gboolean
-export_dir (const char    *app,
-            const char    *branch,
-            const char    *arch,
-            int            source_parent_fd,
-            const char    *source_name,
-            const char    *source_symlink_prefix,
-            const char    *source_relpath,
-            int            destination_parent_fd,
-            const char    *destination_name,
-            GCancellable  *cancellable,
-            GError       **error)
+checkout_incremental (XdgAppDir *self,
+                      const char *from_checksum,
+                      const char *checksum,
+                      GFile *checkoutdir,
+                      GCancellable *cancellable,
+                      GError **error)
 {
   gboolean ret = FALSE;
-  int res;
-  gs_dirfd_iterator_cleanup GSDirFdIterator source_iter;
-  gs_fd_close int destination_dfd = -1;
-  gs_unref_hashtable GHashTable *visited_children = NULL;
-  struct dirent *dent;
+  gs_unref_object GFile *from_root = NULL;
+  gs_unref_object GFile *to_root = NULL;
+  gs_unref_variant GVariant *from_commit = NULL;
+  gs_unref_variant GVariant *to_commit = NULL;
+  gs_free char *from_root_tree = NULL;
+  gs_free char *from_root_meta = NULL;
+  gs_free char *to_root_tree = NULL;
+  gs_free char *to_root_meta = NULL;
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *from_dir = NULL;
+  gs_unref_object GFile *export = NULL;
+  gs_unref_object GFile *to_export = NULL;
+  gs_unref_ptrarray GPtrArray *modified = NULL;
+  gs_unref_ptrarray GPtrArray *removed = NULL;
+  gs_unref_ptrarray GPtrArray *added = NULL;
+  gs_free char *dotref = NULL;
+  gs_free char *deploy_data = NULL;
+  const char *checkoutpath = gs_file_get_path_cached (checkoutdir);
+  int i;
 
-  if (!gs_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
+  if (self->devino_cache == NULL)
+    self->devino_cache = ostree_repo_devino_cache_new ();
+
+  deploy_base = g_file_get_parent (checkoutdir);
+  from_dir = g_file_get_child (deploy_base, from_checksum);
+
+  if (!ostree_repo_read_commit (self->repo, from_checksum, &from_root, NULL, cancellable, error) ||
+      !ostree_repo_read_commit (self->repo, checksum, &to_root, NULL, cancellable, error))
     goto out;
 
-  visited_children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  modified = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_diff_item_unref);
+  removed = g_ptr_array_new_with_free_func (g_object_unref);
+  added = g_ptr_array_new_with_free_func (g_object_unref);
 
-  do
-    res = mkdirat (destination_parent_fd, destination_name, 0777);
-  while (G_UNLIKELY (res == -1 && errno == EINTR));
-  if (res == -1)
-    {
-      if (errno != EEXIST)
-        {
-          gs_set_error_from_errno (error, errno);
-          goto out;
-        }
-    }
+  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, from_root, to_root,
+                         modified, removed, added,
+                         cancellable, error))
+    goto out;
 
-  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
-                               &destination_dfd,
-                               cancellable, error))
+  g_debug ("Deploying %s incrementally: %u modified, %u removed, %u added",
+           checksum, modified->len, removed->len, added->len);
+
+  if (!clone_tree_dir (AT_FDCWD, gs_file_get_path_cached (from_dir),
+                       AT_FDCWD, checkoutpath,
+                       cancellable, error))
     goto out;
 
-  while (TRUE)
+  /* Don't share the lock file and deploy data of the old deployment,
+     deploying creates new ones */
+  dotref = g_build_filename (checkoutpath, "files/.ref", NULL);
+  deploy_data = g_build_filename (checkoutpath, "deploy", NULL);
+  if ((unlink (dotref) != 0 && errno != ENOENT) ||
+      (unlink (deploy_data) != 0 && errno != ENOENT))
     {
-      struct stat stbuf;
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
 
-      if (!gs_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
+  for (i = 0; i < removed->len; i++)
+    {
+      const char *path = gs_file_get_path_cached (g_ptr_array_index (removed, i));
+      gs_unref_object GFile *target = g_file_resolve_relative_path (checkoutdir, path + 1);
+
+      if (!gs_shutil_rm_rf (target, cancellable, error))
         goto out;
+    }
 
-      if (dent == NULL)
-        break;
+  for (i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *item = g_ptr_array_index (modified, i);
+      const char *path = gs_file_get_path_cached (item->target);
+      gs_free char *target = g_build_filename (checkoutpath, path, NULL);
 
-      if (g_hash_table_contains (visited_children, dent->d_name))
-          continue;
+      /* Directories are never reported as modified */
+      if (unlink (target) != 0)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (!checkout_file_at (self, self->repo, item->target_checksum, AT_FDCWD, target,
+                             cancellable, error))
+        {
+          g_prefix_error (error, "While checking out %s: ", path);
+          goto out;
+        }
+    }
 
-      /* Avoid processing the same file again if it was re-created during an export */
-      g_hash_table_insert (visited_children, g_strdup (dent->d_name), GINT_TO_POINTER(1));
+  for (i = 0; i < added->len; i++)
+    {
+      GFile *item = g_ptr_array_index (added, i);
+      const char *path = gs_file_get_path_cached (item);
+      gs_free char *target = g_build_filename (checkoutpath, path, NULL);
 
-      if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+      if (g_file_query_file_type (item, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                  cancellable) == G_FILE_TYPE_DIRECTORY)
         {
-          int errsv = errno;
-          if (errsv == ENOENT)
-            continue;
-          else
+          if (!checkout_subpath (self, checksum, path, target, cancellable, error))
             {
-              gs_set_error_from_errno (error, errsv);
+              g_prefix_error (error, "While checking out %s: ", path);
               goto out;
             }
         }
-
-      if (S_ISDIR (stbuf.st_mode))
+      else if (!checkout_file_at (self, self->repo,
+                                  ostree_repo_file_get_checksum (OSTREE_REPO_FILE (item)),
+                                  AT_FDCWD, target,
+                                  cancellable, error))
         {
-          gs_free gchar *child_symlink_prefix = g_build_filename ("..", source_symlink_prefix, dent->d_name, NULL);
-          gs_free gchar *child_relpath = g_strconcat (source_relpath, dent->d_name, "/", NULL);
-
-          if (!export_dir (app, branch, arch,
-                           source_iter.fd, dent->d_name, child_symlink_prefix, child_relpath, destination_dfd, dent->d_name,
-                           cancellable, error))
-            goto out;
+          g_prefix_error (error, "While checking out %s: ", path);
+          goto out;
         }
-      else if (S_ISREG (stbuf.st_mode))
-        {
-          gs_free gchar *target = NULL;
+    }
 
-          if (!xdg_app_has_name_prefix (dent->d_name, app))
-            {
-              g_warning ("Non-prefixed filename %s in app %s, ignoring.\n", dent->d_name, app);
-              continue;
-            }
+  /* The desktop files in export/ were rewritten when deploying the
+     old version, so take them from the commit again */
+  export = g_file_get_child (checkoutdir, "export");
+  to_export = g_file_get_child (to_root, "export");
+  if (!gs_shutil_rm_rf (export, cancellable, error))
+    goto out;
+  if (g_file_query_exists (to_export, cancellable) &&
+      !checkout_subpath (self, checksum, "/export", gs_file_get_path_cached (export),
+                         cancellable, error))
+    goto out;
 
-          if (g_str_has_suffix (dent->d_name, ".desktop") || g_str_has_suffix (dent->d_name, ".service"))
-            {
-              gs_free gchar *new_name = NULL;
+  /* The cloned directories still have the metadata of the old commit */
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, from_checksum, &from_commit, error) ||
+      !ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, checksum, &to_commit, error))
+    goto out;
 
-              if (!export_desktop_file (app, branch, arch, source_iter.fd, dent->d_name, &stbuf, &new_name, cancellable, error))
-                goto out;
+  get_commit_root (from_commit, &from_root_tree, &from_root_meta);
+  get_commit_root (to_commit, &to_root_tree, &to_root_meta);
 
-              g_hash_table_insert (visited_children, g_strdup (new_name), GINT_TO_POINTER(1));
+  if (!update_dirmeta (self, checkoutpath,
+                       from_root_tree, from_root_meta,
+                       to_root_tree, to_root_meta,
+                       cancellable, error))
+    goto out;
 
-              if (renameat (source_iter.fd, new_name, source_iter.fd, dent->d_name) != 0)
-                {
-                  gs_set_error_from_errno (error, errno);
-                  goto out;
-                }
-            }
+  ret = TRUE;
+ out:
+  return ret;
+}
 
-          target = g_build_filename (source_symlink_prefix, dent->d_name, NULL);
+static int
+compare_export_paths (gconstpointer a,
+                      gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
 
-          if (unlinkat (destination_dfd, dent->d_name, 0) != 0 && errno != ENOENT)
-            {
-              gs_set_error_from_errno (error, errno);
-              goto out;
-            }
+/* Returns the local ref that keeps the commit of a deployment from
+   being pruned while it is deployed */
+static char *
+get_deploy_ref (const char *ref,
+                const char *checksum)
+{
+  return g_strconcat ("deploy/", ref, "/", checksum, NULL);
+}
 
-          if (symlinkat (target, destination_dfd, dent->d_name) != 0)
-            {
-              gs_set_error_from_errno (error, errno);
-              goto out;
-            }
-        }
-      else
-        {
-          g_warning ("Not exporting file %s of unsupported type\n", source_relpath);
-        }
+/* Returns whether new deployments are made as images, as set with
+   "ostree config set xdg-app.deploy-images true". The helper only
+   mounts images of system deployments, so user installations never are. */
+static gboolean
+use_deploy_images (XdgAppDir *self)
+{
+  GKeyFile *config;
+
+  if (self->user)
+    return FALSE;
+
+  config = ostree_repo_get_config (self->repo);
+  return g_key_file_get_boolean (config, "xdg-app", "deploy-images", NULL);
+}
+
+/* Replaces the files directory of the deployment in checkoutdir with a
+   squashfs image of it, which the helper mounts instead. Undeploying
+   then removes a single file instead of the whole tree. */
+static gboolean
+build_deploy_image (GFile *checkoutdir,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *files = NULL;
+  gs_unref_object GFile *image = NULL;
+  const char *argv[] = { "mksquashfs", NULL, NULL, "-noappend", "-no-progress", NULL };
+  int status;
+
+  files = g_file_get_child (checkoutdir, "files");
+  image = g_file_get_child (checkoutdir, XDG_APP_DEPLOY_IMAGE);
+  argv[1] = gs_file_get_path_cached (files);
+  argv[2] = gs_file_get_path_cached (image);
+
+  if (!g_spawn_sync (NULL, (char **)argv, NULL,
+                     G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                     NULL, NULL, NULL, NULL, &status, error) ||
+      !g_spawn_check_exit_status (status, error))
+    {
+      g_prefix_error (error, "While building image of %s: ", argv[1]);
+      goto out;
+    }
+
+  /* The helper refuses images that anyone but root can change */
+  if (chmod (argv[2], 0644) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
     }
 
+  if (!gs_shutil_rm_rf (files, cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
-
   return ret;
 }
 
-gboolean
-xdg_app_export_dir (const char *app,
-                    const char *branch,
-                    const char *arch,
-                    GFile    *source,
-                    GFile    *destination,
-                    const char *symlink_prefix,
-                    GCancellable  *cancellable,
-                    GError       **error)
+static gboolean
+write_deploy_data (XdgAppDir *self,
+                   const char *ref,
+                   const char *checksum,
+                   GFile *checkoutdir,
+                   GCancellable *cancellable,
+                   GError **error)
 {
   gboolean ret = FALSE;
+  gs_unref_variant GVariant *commit = NULL;
+  gs_unref_variant GVariant *deploy_data = NULL;
+  gs_unref_object GFile *metadata = NULL;
+  gs_unref_object GFile *data_file = NULL;
+  gs_unref_ptrarray GPtrArray *exports = NULL;
+  gs_free char *metadata_contents = NULL;
+  gs_strfreev char **ref_parts = NULL;
+  const char *app = NULL;
+  guint64 timestamp;
+  guint64 installed_size = 0;
+  guint64 n_files = 0;
+  GError *temp_error = NULL;
 
-  if (!gs_file_ensure_directory (destination, TRUE, cancellable, error))
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                 &commit, error))
     goto out;
 
-  /* The fds are closed by this call */
-  if (!export_dir (app, branch, arch,
-                   AT_FDCWD, gs_file_get_path_cached (source), symlink_prefix, "",
-                   AT_FDCWD, gs_file_get_path_cached (destination),
-                   cancellable, error))
+  g_variant_get_child (commit, 5, "t", &timestamp);
+
+  metadata = g_file_get_child (checkoutdir, "metadata");
+  if (!g_file_load_contents (metadata, cancellable, &metadata_contents, NULL, NULL, &temp_error))
+    {
+      if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
+    }
+
+  if (g_str_has_prefix (ref, "app/"))
+    {
+      ref_parts = g_strsplit (ref, "/", -1);
+      app = ref_parts[1];
+    }
+
+  exports = g_ptr_array_new_with_free_func (g_free);
+  if (!scan_deployment (AT_FDCWD, gs_file_get_path_cached (checkoutdir), "", app,
+                        &installed_size, &n_files, exports,
+                        cancellable, error))
+    goto out;
+  g_ptr_array_sort (exports, compare_export_paths);
+
+  deploy_data = g_variant_ref_sink (g_variant_new ("(ststt@as)",
+                                                   checksum,
+                                                   GUINT64_FROM_BE (timestamp),
+                                                   metadata_contents ? metadata_contents : "",
+                                                   installed_size,
+                                                   n_files,
+                                                   g_variant_new_strv ((const char * const *)exports->pdata,
+                                                                       exports->len)));
+
+  data_file = g_file_get_child (checkoutdir, "deploy");
+  if (!g_file_replace_contents (data_file,
+                                g_variant_get_data (deploy_data),
+                                g_variant_get_size (deploy_data),
+                                NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                cancellable, error))
     goto out;
 
   ret = TRUE;
-
  out:
   return ret;
 }
 
+/* Flushes everything written to the filesystem of the installation,
+   which is much faster than syncing every file of a deployment */
 static gboolean
-xdg_app_dir_update_exports (XdgAppDir *self,
-                            GCancellable *cancellable,
-                            GError **error)
+sync_dir (XdgAppDir *self,
+          GError **error)
 {
-  gboolean ret = FALSE;
-  gs_unref_object GFile *exports = NULL;
+  gs_fd_close int fd = -1;
 
-  exports = xdg_app_dir_get_exports_dir (self);
-
-  if (g_file_query_exists (exports, cancellable))
+  fd = open (gs_file_get_path_cached (self->basedir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || syncfs (fd) != 0)
     {
-      if (!xdg_app_remove_dangling_symlinks (exports, cancellable, error))
-        goto out;
-
-      if (!xdg_app_dir_run_triggers (self, cancellable, error))
-        goto out;
+      gs_set_error_from_errno (error, errno);
+      return FALSE;
     }
 
-  ret = TRUE;
-
- out:
-  return ret;
+  return TRUE;
 }
 
 gboolean
@@ -796,20 +4840,25 @@ xdg_app_dir_deploy (XdgAppDir *self,
 {
   gboolean ret = FALSE;
   gboolean is_app;
+  gboolean checked_out = FALSE;
+  gboolean remove_on_error = FALSE;
   gs_free char *resolved_ref = NULL;
-  gs_unref_object GFile *root = NULL;
-  gs_unref_object GFileInfo *file_info = NULL;
+  gs_free char *active = NULL;
+  gs_free char *deploy_ref = NULL;
   gs_unref_object GFile *deploy_base = NULL;
   gs_unref_object GFile *checkoutdir = NULL;
   gs_unref_object GFile *dotref = NULL;
   gs_unref_object GFile *export = NULL;
-  gs_unref_object GFile *exports = NULL;
+  DeploySubset *subset = NULL;
 
   if (!xdg_app_dir_ensure_repo (self, cancellable, error))
     goto out;
 
   deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
 
+  if (!load_deploy_subset (self, ref, &subset, error))
+    goto out;
+
   if (checksum == NULL)
     {
       g_debug ("No checksum specified, getting tip of %s", ref);
@@ -829,73 +4878,92 @@ xdg_app_dir_deploy (XdgAppDir *self,
       g_debug ("Looking for checksum %s in local repo", checksum);
       if (!ostree_repo_read_commit (self->repo, checksum, &root, &commit, cancellable, NULL))
         {
-           GSConsole *console = NULL;
-           gs_unref_object OstreeAsyncProgress *progress = NULL;
-           const char *refs[2];
            gs_unref_object GFile *origin = NULL;
            gs_free char *repository = NULL;
 
-           refs[0] = checksum;
-           refs[1] = NULL;
-
            origin = g_file_get_child (deploy_base, "origin");
            if (!g_file_load_contents (origin, cancellable, &repository, NULL, NULL, error))
              goto out;
 
            g_debug ("Pulling checksum %s from remote %s", checksum, repository);
 
-           console = gs_console_get ();
-           if (console)
-             {
-               gs_console_begin_status_line (console, "", NULL, NULL);
-               progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, console);
-             }
-
-           if (!ostree_repo_pull (self->repo, repository,
-                                  (char **)refs, OSTREE_REPO_PULL_FLAGS_NONE,
-                                  progress,
-                                  cancellable, error))
-             {
-               g_prefix_error (error, "Failed to pull %s from remote %s: ", checksum, repository);
-               goto out;
-             }
+           if (!pull_subset (self, repository, checksum, subset, cancellable, error))
+             goto out;
         }
     }
 
   checkoutdir = g_file_get_child (deploy_base, checksum);
   if (g_file_query_exists (checkoutdir, cancellable))
     {
-      g_set_error (error, XDG_APP_DIR_ERROR,
-                   XDG_APP_DIR_ERROR_ALREADY_DEPLOYED,
-                   "%s version %s already deployed", ref, checksum);
-      goto out;
+      gs_unref_object GFile *data_file = g_file_get_child (checkoutdir, "deploy");
+      gs_free char *current = xdg_app_dir_read_active (self, ref, cancellable);
+
+      /* Only deployments that were interrupted before they were
+         complete have no deploy data, or active ones made by older
+         versions */
+      if (g_file_query_exists (data_file, cancellable) ||
+          g_strcmp0 (current, checksum) == 0)
+        {
+          g_set_error (error, XDG_APP_DIR_ERROR,
+                       XDG_APP_DIR_ERROR_ALREADY_DEPLOYED,
+                       "%s version %s already deployed", ref, checksum);
+          goto out;
+        }
+
+      g_debug ("Removing incomplete deployment %s", gs_file_get_path_cached (checkoutdir));
+      if (!gs_shutil_rm_rf (checkoutdir, cancellable, error))
+        goto out;
     }
 
-  if (!ostree_repo_read_commit (self->repo, checksum, &root, NULL, cancellable, error))
+  /* A half written deployment would be taken as deployed later */
+  remove_on_error = TRUE;
+
+  /* Nothing is synced while checking out, the whole deployment is
+     synced at once before it is made active */
+  ostree_repo_set_disable_fsync (self->repo, TRUE);
+
+  /* Diffing needs both commits complete, which subsets may not be,
+     and a copy of the active deployment, which images are not */
+  active = xdg_app_dir_read_active (self, ref, cancellable);
+  if (active != NULL)
     {
-      g_prefix_error (error, "Failed to read commit %s: ", checksum);
-      goto out;
-    }
+      gs_unref_object GFile *active_dir = g_file_get_child (deploy_base, active);
+      gs_unref_object GFile *active_image = g_file_get_child (active_dir, XDG_APP_DEPLOY_IMAGE);
 
-  file_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (file_info == NULL)
-    goto out;
+      if (subset != NULL || g_file_query_exists (active_image, cancellable))
+        g_clear_pointer (&active, g_free);
+    }
 
-  if (!ostree_repo_checkout_tree (self->repo,
-                                  self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE,
-                                  OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
-                                  checkoutdir,
-                                  OSTREE_REPO_FILE (root), file_info,
-                                  cancellable, error))
+  if (active != NULL)
     {
-      gs_free char *rootpath = NULL;
-      gs_free char *checkoutpath = NULL;
+      GError *temp_error = NULL;
+
+      if (checkout_incremental (self, active, checksum, checkoutdir, cancellable, &temp_error))
+        checked_out = TRUE;
+      else
+        {
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
 
-      rootpath = g_file_get_path (root);
-      checkoutpath = g_file_get_path (checkoutdir);
-      g_prefix_error (error, "While trying to checkout %s into %s: ", rootpath, checkoutpath);
+          /* Not an error, but it costs the whole point of deploying
+             incrementally, so make it visible */
+          g_warning ("Can't deploy %s incrementally, checking out everything: %s",
+                     checksum, temp_error->message);
+          g_error_free (temp_error);
+
+          if (!gs_shutil_rm_rf (checkoutdir, cancellable, error))
+            goto out;
+        }
+    }
+
+  if (!checked_out &&
+      !checkout_commit (self, checksum, subset, checkoutdir, cancellable, error))
+    {
+      g_prefix_error (error, "While trying to checkout %s into %s: ",
+                      checksum, gs_file_get_path_cached (checkoutdir));
       goto out;
     }
 
@@ -906,37 +4974,60 @@ xdg_app_dir_deploy (XdgAppDir *self,
 
   is_app = g_str_has_prefix (ref, "app");
 
-  exports = xdg_app_dir_get_exports_dir (self);
   if (is_app)
     {
       export = g_file_get_child (checkoutdir, "export");
       if (g_file_query_exists (export, cancellable))
         {
-          gs_free char *relative_path = NULL;
-          gs_free char *symlink_prefix = NULL;
           gs_strfreev char **ref_parts = NULL;
-
-          relative_path = g_file_get_relative_path (self->basedir, export);
-          symlink_prefix = g_build_filename ("..", relative_path, NULL);
+          gs_unref_object GFile *cache = NULL;
+          gs_fd_close int cache_dfd = -1;
 
           ref_parts = g_strsplit (ref, "/", -1);
 
-          if (!xdg_app_export_dir (ref_parts[1], ref_parts[3], ref_parts[2], export, exports,
-                                   symlink_prefix,
-                                   cancellable,
-                                   error))
+          cache = xdg_app_dir_get_export_cache_dir (self);
+          if (!gs_file_ensure_directory (cache, TRUE, cancellable, error) ||
+              !gs_file_open_dir_fd_at (AT_FDCWD, gs_file_get_path_cached (cache),
+                                       &cache_dfd, cancellable, error))
+            goto out;
+
+          if (!export_dir (ref_parts[1], ref_parts[3], ref_parts[2],
+                           gs_file_get_path_cached (export), cache_dfd,
+                           cancellable, error))
             goto out;
         }
     }
 
-  if (!xdg_app_dir_set_active (self, ref, checksum, cancellable, error))
+  /* The deploy data describes the files, so it is written before they
+     are replaced by an image */
+  if (!write_deploy_data (self, ref, checksum, checkoutdir, cancellable, error))
+    goto out;
+
+  if (use_deploy_images (self) &&
+      !build_deploy_image (checkoutdir, cancellable, error))
+    goto out;
+
+  if (!self->no_sync && !sync_dir (self, error))
     goto out;
 
-  if (is_app && !xdg_app_dir_update_exports (self, cancellable, error))
+  deploy_ref = get_deploy_ref (ref, checksum);
+  if (!ostree_repo_set_ref_immediate (self->repo, NULL, deploy_ref, checksum,
+                                      cancellable, error))
+    goto out;
+
+  /* Complete now, so it can be made active again later */
+  remove_on_error = FALSE;
+
+  if (!xdg_app_dir_set_active (self, ref, checksum, cancellable, error))
     goto out;
 
   ret = TRUE;
  out:
+  if (!ret && remove_on_error)
+    gs_shutil_rm_rf (checkoutdir, NULL, NULL);
+  if (self->repo)
+    ostree_repo_set_disable_fsync (self->repo, self->no_sync);
+  deploy_subset_free (subset);
   return ret;
 }
 
@@ -997,6 +5088,213 @@ xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
   return ret;
 }
 
+/* Lists the full refs of all deployed apps or runtimes, depending on
+   whether @kind is "app" or "runtime". */
+gboolean
+xdg_app_dir_list_refs (XdgAppDir *self,
+                       const char *kind,
+                       char ***refs_out,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *dir = NULL;
+  gs_unref_ptrarray GPtrArray *refs = NULL;
+
+  refs = g_ptr_array_new_with_free_func (g_free);
+
+  dir = g_file_get_child (self->basedir, kind);
+  if (g_file_query_exists (dir, cancellable) &&
+      !collect_refs (dir, kind, 3, refs, cancellable, error))
+    goto out;
+
+  g_ptr_array_add (refs, NULL);
+  *refs_out = (char **)g_ptr_array_free (refs, FALSE);
+  refs = NULL;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+gboolean
+xdg_app_dir_read_origin (XdgAppDir *self,
+                         const char *ref,
+                         char **out_origin,
+                         GCancellable *cancellable,
+                         GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *deploy_base = NULL;
+  gs_unref_object GFile *origin = NULL;
+  gs_free char *repository = NULL;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  origin = g_file_get_child (deploy_base, "origin");
+  if (!g_file_load_contents (origin, cancellable, &repository, NULL, NULL, error))
+    goto out;
+
+  gs_transfer_out_value (out_origin, &repository);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Like xdg_app_dir_list_refs(), but returns a hash table from the name
+   of each remote to an array of the refs that were installed from it */
+gboolean
+xdg_app_dir_list_refs_by_origin (XdgAppDir *self,
+                                 const char *kind,
+                                 GHashTable **out_refs_by_origin,
+                                 GCancellable *cancellable,
+                                 GError **error)
+{
+  gboolean ret = FALSE;
+  gs_strfreev char **refs = NULL;
+  gs_unref_hashtable GHashTable *refs_by_origin = NULL;
+  int i;
+
+  if (!xdg_app_dir_list_refs (self, kind, &refs, cancellable, error))
+    goto out;
+
+  refs_by_origin = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      gs_free char *origin = NULL;
+      GPtrArray *origin_refs;
+
+      if (!xdg_app_dir_read_origin (self, refs[i], &origin, cancellable, error))
+        goto out;
+
+      origin_refs = g_hash_table_lookup (refs_by_origin, origin);
+      if (origin_refs == NULL)
+        {
+          origin_refs = g_ptr_array_new_with_free_func (g_free);
+          g_hash_table_insert (refs_by_origin, g_strdup (origin), origin_refs);
+        }
+
+      g_ptr_array_add (origin_refs, g_strdup (refs[i]));
+    }
+
+  gs_transfer_out_value (out_refs_by_origin, &refs_by_origin);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Returns whether the session helper looks for updates of this
+   installation in the background, as set with
+   "ostree config set xdg-app.prefetch-updates true". */
+gboolean
+xdg_app_dir_get_prefetch_updates (XdgAppDir *self,
+                                  GCancellable *cancellable)
+{
+  gs_unref_object GFile *repodir = NULL;
+  GKeyFile *config;
+
+  /* Don't create the repo just to look at its config */
+  repodir = g_file_get_child (self->basedir, "repo");
+  if (!g_file_query_exists (repodir, cancellable) ||
+      !xdg_app_dir_ensure_repo (self, cancellable, NULL))
+    return FALSE;
+
+  config = ostree_repo_get_config (self->repo);
+  return g_key_file_get_boolean (config, "xdg-app", "prefetch-updates", NULL);
+}
+
+/* Finds the deployed refs that have a newer commit in the summary of
+   their remote, and returns a hash table from each of them to the new
+   commit. If @pull is TRUE the new commits are also pulled, without
+   deploying them, so that a later update only has to deploy. Remotes
+   that can't be reached are skipped. */
+gboolean
+xdg_app_dir_prefetch_updates (XdgAppDir *self,
+                              gboolean pull,
+                              GHashTable **out_pending,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *pending = NULL;
+  const char *kinds[] = { "runtime", "app" };
+  int k;
+
+  pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  for (k = 0; k < G_N_ELEMENTS (kinds); k++)
+    {
+      gs_unref_hashtable GHashTable *refs_by_origin = NULL;
+      GHashTableIter iter;
+      gpointer key, value;
+
+      if (!xdg_app_dir_list_refs_by_origin (self, kinds[k], &refs_by_origin, cancellable, error))
+        goto out;
+
+      if (g_hash_table_size (refs_by_origin) > 0 &&
+          !xdg_app_dir_ensure_repo (self, cancellable, error))
+        goto out;
+
+      g_hash_table_iter_init (&iter, refs_by_origin);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          const char *repository = key;
+          GPtrArray *refs = value;
+          XdgAppSummary *summary;
+          gs_unref_ptrarray GPtrArray *outdated = NULL;
+          GError *temp_error = NULL;
+          int i;
+
+          summary = load_remote_summary (self, repository, cancellable);
+          if (summary == NULL)
+            continue;
+
+          outdated = g_ptr_array_new ();
+
+          for (i = 0; i < refs->len; i++)
+            {
+              const char *ref = g_ptr_array_index (refs, i);
+              const guint8 *csum;
+              char checksum[65];
+              gs_free char *active = NULL;
+
+              if (!xdg_app_summary_lookup_ref (summary, ref, &csum))
+                continue;
+
+              ostree_checksum_inplace_from_bytes (csum, checksum);
+              active = xdg_app_dir_read_active (self, ref, cancellable);
+              if (g_strcmp0 (active, checksum) == 0)
+                continue;
+
+              g_hash_table_insert (pending, g_strdup (ref), g_strdup (checksum));
+              g_ptr_array_add (outdated, (char *)ref);
+            }
+
+          g_ptr_array_add (outdated, NULL);
+          if (pull && outdated->len > 1 &&
+              !xdg_app_dir_pull_updates (self, repository, (const char **)outdated->pdata,
+                                         summary, cancellable, &temp_error))
+            {
+              g_message ("Failed to pull updates from %s: %s", repository, temp_error->message);
+              g_clear_error (&temp_error);
+            }
+
+          xdg_app_summary_free (summary);
+
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            goto out;
+        }
+    }
+
+  gs_transfer_out_value (out_pending, &pending);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 gboolean
 xdg_app_dir_list_deployed (XdgAppDir *self,
                            const char *ref,
@@ -1056,6 +5354,140 @@ xdg_app_dir_list_deployed (XdgAppDir *self,
 
 }
 
+typedef struct {
+  char *checksum;
+  guint64 timestamp;
+} DeploymentAge;
+
+static int
+compare_deployment_ages (const void *a,
+                         const void *b)
+{
+  const DeploymentAge *age_a = a;
+  const DeploymentAge *age_b = b;
+
+  if (age_a->timestamp != age_b->timestamp)
+    return age_a->timestamp < age_b->timestamp ? 1 : -1;
+
+  return strcmp (age_a->checksum, age_b->checksum);
+}
+
+/* Like xdg_app_dir_list_deployed(), but sorted from the newest commit
+   to the oldest. Deployments made by older versions, which have no
+   deploy data, come last. */
+gboolean
+xdg_app_dir_list_deployed_by_age (XdgAppDir *self,
+                                  const char *ref,
+                                  char ***deployed_checksums,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+  gboolean ret = FALSE;
+  gs_strfreev char **deployed = NULL;
+  gs_free DeploymentAge *ages = NULL;
+  guint n_deployed, i;
+
+  if (!xdg_app_dir_list_deployed (self, ref, &deployed, cancellable, error))
+    goto out;
+
+  n_deployed = g_strv_length (deployed);
+  ages = g_new0 (DeploymentAge, n_deployed);
+
+  for (i = 0; i < n_deployed; i++)
+    {
+      gs_unref_variant GVariant *deploy_data = NULL;
+
+      deploy_data = xdg_app_dir_get_deploy_data (self, ref, deployed[i], cancellable, NULL);
+      ages[i].checksum = deployed[i];
+      if (deploy_data != NULL)
+        ages[i].timestamp = xdg_app_deploy_data_get_timestamp (deploy_data);
+    }
+
+  qsort (ages, n_deployed, sizeof (DeploymentAge), compare_deployment_ages);
+
+  /* The strings move to the sorted array */
+  for (i = 0; i < n_deployed; i++)
+    deployed[i] = ages[i].checksum;
+
+  *deployed_checksums = deployed;
+  deployed = NULL;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Returns how many deployments of each ref are kept, as set with
+   "ostree config set xdg-app.keep-deployments N". The active one
+   counts, so the default of 1 keeps no earlier deployments. */
+static guint
+get_kept_deployments (XdgAppDir *self)
+{
+  GKeyFile *config;
+  int keep;
+
+  config = ostree_repo_get_config (self->repo);
+  keep = g_key_file_get_integer (config, "xdg-app", "keep-deployments", NULL);
+
+  return MAX (keep, 1);
+}
+
+/* Undeploys the oldest deployments of ref that are not kept, see
+   get_kept_deployments(). The active deployment is always kept, and
+   the newest of the others after it, for xdg-app rollback. The
+   commits of kept deployments are not pruned, as every deployment
+   has a ref. */
+gboolean
+xdg_app_dir_undeploy_old (XdgAppDir *self,
+                          const char *ref,
+                          gboolean force_remove,
+                          gboolean *out_undeployed,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+  gboolean ret = FALSE;
+  gs_strfreev char **deployed = NULL;
+  gs_free char *active = NULL;
+  guint keep, kept = 0;
+  int i;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  keep = get_kept_deployments (self);
+  active = xdg_app_dir_read_active (self, ref, cancellable);
+  if (active != NULL)
+    kept++;
+
+  if (!xdg_app_dir_list_deployed_by_age (self, ref, &deployed, cancellable, error))
+    goto out;
+
+  for (i = 0; deployed[i] != NULL; i++)
+    {
+      if (g_strcmp0 (deployed[i], active) == 0)
+        continue;
+
+      if (kept < keep)
+        {
+          kept++;
+          continue;
+        }
+
+      g_debug ("Undeploying %s commit %s", ref, deployed[i]);
+
+      if (!xdg_app_dir_undeploy (self, ref, deployed[i], force_remove,
+                                 cancellable, error))
+        goto out;
+
+      if (out_undeployed)
+        *out_undeployed = TRUE;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 dir_is_locked (GFile *dir)
 {
@@ -1063,6 +5495,8 @@ dir_is_locked (GFile *dir)
   struct flock lock = {0};
   gs_unref_object GFile *reffile = NULL;
 
+  /* Deployments made as images don't have this, and can be removed
+     while they are mounted */
   reffile = g_file_resolve_relative_path (dir, "files/.ref");
 
   ref_fd = open (gs_file_get_path_cached (reffile), O_RDWR | O_CLOEXEC);
@@ -1095,7 +5529,7 @@ xdg_app_dir_undeploy (XdgAppDir *self,
   gs_unref_object GFile *removed_dir = NULL;
   gs_free char *tmpname = NULL;
   gs_free char *active = NULL;
-  gboolean is_app;
+  gs_free char *deploy_ref = NULL;
   int i;
 
   g_assert (ref != NULL);
@@ -1155,17 +5589,17 @@ xdg_app_dir_undeploy (XdgAppDir *self,
                        cancellable, error))
     goto out;
 
+  deploy_ref = get_deploy_ref (ref, checksum);
+  if (!ostree_repo_set_ref_immediate (self->repo, NULL, deploy_ref, NULL,
+                                      cancellable, error))
+    goto out;
+
   if (force_remove || !dir_is_locked (removed_subdir))
     {
       if (!gs_shutil_rm_rf (removed_subdir, cancellable, error))
 	goto out;
     }
 
-  is_app = g_str_has_prefix (ref, "app");
-
-  if (is_app && !xdg_app_dir_update_exports (self, cancellable, error))
-    goto out;
-
   ret = TRUE;
  out:
   return ret;
@@ -1219,6 +5653,44 @@ xdg_app_dir_cleanup_removed (XdgAppDir      *self,
 }
 
 
+/* Removes the files in the export cache that no deployment links to
+   anymore */
+static gboolean
+prune_export_cache (GFile          *cache,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_dirfd_iterator_cleanup GSDirFdIterator iter;
+  struct dirent *dent;
+
+  if (!gs_dirfd_iterator_init_at (AT_FDCWD, gs_file_get_path_cached (cache), FALSE, &iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!gs_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          S_ISREG (stbuf.st_mode) && stbuf.st_nlink == 1 &&
+          unlinkat (iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 gboolean
 xdg_app_dir_prune (XdgAppDir      *self,
                    GCancellable   *cancellable,
@@ -1228,10 +5700,16 @@ xdg_app_dir_prune (XdgAppDir      *self,
   gint objects_total, objects_pruned;
   guint64 pruned_object_size_total;
   gs_free char *formatted_freed_size = NULL;
+  gs_unref_object GFile *cache = NULL;
 
   if (!xdg_app_dir_ensure_repo (self, cancellable, error))
     goto out;
 
+  cache = xdg_app_dir_get_export_cache_dir (self);
+  if (g_file_query_exists (cache, cancellable) &&
+      !prune_export_cache (cache, cancellable, error))
+    goto out;
+
   if (!ostree_repo_prune (self->repo,
                           OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY,
                           0,
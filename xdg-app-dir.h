@@ -3,6 +3,8 @@
 
 #include <ostree.h>
 
+#include "xdg-app-utils.h"
+
 typedef struct XdgAppDir XdgAppDir;
 
 #define XDG_APP_TYPE_DIR xdg_app_dir_get_type()
@@ -13,6 +15,12 @@ GType xdg_app_dir_get_type (void);
 
 #define XDG_APP_DIR_ERROR xdg_app_dir_error_quark()
 
+typedef enum {
+  XDG_APP_DIR_REPAIR_FLAGS_NONE = 0,
+  XDG_APP_DIR_REPAIR_FLAGS_FAST = 1 << 0,
+  XDG_APP_DIR_REPAIR_FLAGS_DRY_RUN = 1 << 1,
+} XdgAppDirRepairFlags;
+
 typedef enum {
   XDG_APP_DIR_ERROR_ALREADY_DEPLOYED,
   XDG_APP_DIR_ERROR_ALREADY_UNDEPLOYED,
@@ -20,6 +28,14 @@ typedef enum {
 
 GQuark       xdg_app_dir_error_quark      (void);
 
+/* Deployments made with deploy-images set in the repo config have
+   this squashfs image instead of a files directory */
+#define XDG_APP_DEPLOY_IMAGE "files.squashfs"
+
+/* commit, commit timestamp, metadata, installed size, number of files, exports */
+#define XDG_APP_DEPLOY_DATA_GVARIANT_STRING "(ststtas)"
+#define XDG_APP_DEPLOY_DATA_GVARIANT_FORMAT G_VARIANT_TYPE (XDG_APP_DEPLOY_DATA_GVARIANT_STRING)
+
 GFile *  xdg_app_get_system_base_dir_location (void);
 GFile *  xdg_app_get_user_base_dir_location   (void);
 
@@ -34,6 +50,7 @@ GFile *     xdg_app_dir_get_deploy_dir  (XdgAppDir      *self,
                                          const char     *ref);
 GFile *     xdg_app_dir_get_exports_dir (XdgAppDir      *self);
 GFile *     xdg_app_dir_get_removed_dir (XdgAppDir      *self);
+GFile *     xdg_app_dir_get_summary_cache_dir (XdgAppDir *self);
 GFile *     xdg_app_dir_get_if_deployed (XdgAppDir      *self,
                                          const char     *ref,
                                          const char     *checksum,
@@ -41,17 +58,59 @@ GFile *     xdg_app_dir_get_if_deployed (XdgAppDir      *self,
 GFile *     xdg_app_dir_get_app_data    (XdgAppDir      *self,
                                          const char     *app);
 OstreeRepo *xdg_app_dir_get_repo        (XdgAppDir      *self);
+void        xdg_app_dir_set_no_sync     (XdgAppDir      *self,
+                                         gboolean        no_sync);
 gboolean    xdg_app_dir_ensure_path     (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
 gboolean    xdg_app_dir_ensure_repo     (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_set_subset      (XdgAppDir      *self,
+                                         const char     *ref,
+                                         const char    **subpaths,
+                                         const char    **languages,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_pull            (XdgAppDir      *self,
                                          const char     *repository,
                                          const char     *ref,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_pull_refs       (XdgAppDir      *self,
+                                         const char     *repository,
+                                         const char    **refs,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_pull_updates    (XdgAppDir      *self,
+                                         const char     *repository,
+                                         const char    **refs,
+                                         XdgAppSummary  *summary,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_estimate_pull   (XdgAppDir      *self,
+                                         const char     *repository,
+                                         const char    **refs,
+                                         XdgAppSummary  *summary,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+
+GFile *     xdg_app_get_deploy_files    (GFile          *deploy_dir);
+GVariant *  xdg_app_load_deploy_data    (GFile          *deploy_dir,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+GVariant *  xdg_app_dir_get_deploy_data (XdgAppDir      *self,
+                                         const char     *ref,
+                                         const char     *checksum,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+const char * xdg_app_deploy_data_get_commit         (GVariant *deploy_data);
+guint64      xdg_app_deploy_data_get_timestamp      (GVariant *deploy_data);
+const char * xdg_app_deploy_data_get_metadata       (GVariant *deploy_data);
+guint64      xdg_app_deploy_data_get_installed_size (GVariant *deploy_data);
+guint64      xdg_app_deploy_data_get_n_files        (GVariant *deploy_data);
+const char **xdg_app_deploy_data_get_exports        (GVariant *deploy_data);
+
 char *      xdg_app_dir_read_active     (XdgAppDir      *self,
                                          const char     *ref,
                                          GCancellable   *cancellable);
@@ -60,11 +119,46 @@ gboolean    xdg_app_dir_set_active      (XdgAppDir      *self,
                                          const char     *checksum,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_list_refs       (XdgAppDir      *self,
+                                         const char     *kind,
+                                         char         ***refs,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_list_refs_by_origin (XdgAppDir  *self,
+                                             const char *kind,
+                                             GHashTable **out_refs_by_origin,
+                                             GCancellable *cancellable,
+                                             GError    **error);
+gboolean    xdg_app_dir_get_prefetch_updates (XdgAppDir    *self,
+                                              GCancellable *cancellable);
+gboolean    xdg_app_dir_prefetch_updates (XdgAppDir     *self,
+                                          gboolean       pull,
+                                          GHashTable   **out_pending,
+                                          GCancellable  *cancellable,
+                                          GError       **error);
+gboolean    xdg_app_dir_read_origin     (XdgAppDir      *self,
+                                         const char     *ref,
+                                         char          **out_origin,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_list_deployed   (XdgAppDir      *self,
                                          const char     *ref,
                                          char         ***deployed_checksums,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_list_deployed_by_age (XdgAppDir      *self,
+                                              const char     *ref,
+                                              char         ***deployed_checksums,
+                                              GCancellable   *cancellable,
+                                              GError        **error);
+gboolean    xdg_app_dir_repair_deployment (XdgAppDir    *self,
+                                           const char   *ref,
+                                           const char   *checksum,
+                                           XdgAppDirRepairFlags flags,
+                                           guint        *out_n_files,
+                                           char       ***out_damaged,
+                                           GCancellable *cancellable,
+                                           GError      **error);
 gboolean    xdg_app_dir_deploy          (XdgAppDir      *self,
                                          const char     *ref,
                                          const char     *checksum,
@@ -76,6 +170,18 @@ gboolean    xdg_app_dir_undeploy        (XdgAppDir      *self,
 					 gboolean        force_remove,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_undeploy_old    (XdgAppDir      *self,
+                                         const char     *ref,
+                                         gboolean        force_remove,
+                                         gboolean       *out_undeployed,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_update_exports  (XdgAppDir      *self,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_verify_exports  (XdgAppDir      *self,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_prune           (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
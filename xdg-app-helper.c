@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -227,7 +228,7 @@ static inline int raw_clone(unsigned long flags, void *child_stack) {
 void
 usage (char **argv)
 {
-  fprintf (stderr, "usage: %s [-n] [-i] [-p <pulsaudio socket>] [-x X11 socket] [-y Wayland socket] [-w] [-W] [-E] [-l] [-m <path to monitor dir>] [-a <path to app>] [-v <path to var>] [-b <target-dir>=<src-dir>] <path to runtime> <command..>\n", argv[0]);
+  fprintf (stderr, "usage: %s [-n] [-i] [-p <pulsaudio socket>] [-x X11 socket] [-y Wayland socket] [-w] [-W] [-E] [-l] [-m <path to monitor dir>] [-a <path to app>] [-v <path to var>] [-b <target-dir>=<src-dir>] <path to runtime or image> <command..>\n", argv[0]);
   exit (1);
 }
 
@@ -445,6 +446,204 @@ bind_mount (const char *src, const char *dest, bind_option_t options)
   return 0;
 }
 
+/* Must match XDG_APP_DEPLOY_IMAGE in xdg-app-dir.h */
+#define DEPLOY_IMAGE "files.squashfs"
+
+/* Only the name is looked at, open_deploy_image() checks the rest */
+static int
+is_image (const char *path)
+{
+  const char *name = strrchr (path, '/');
+
+  return name != NULL && strcmp (name + 1, DEPLOY_IMAGE) == 0;
+}
+
+/* Opens a copy of the device node path created in dir, as the device
+   nodes of the host are usually not accessible to the user */
+static int
+open_device_copy (const char *dir, const char *path, int flags)
+{
+  char *copy = strconcat3 (dir, "/", strrchr (path, '/') + 1);
+  struct stat st;
+  int fd;
+
+  if (stat (path, &st) < 0)
+    die_with_error ("stat %s", path);
+
+  if (!S_ISCHR (st.st_mode) && !S_ISBLK (st.st_mode))
+    die ("%s is not a device", path);
+
+  if (mknod (copy, (st.st_mode & S_IFMT) | 0600, st.st_rdev) < 0)
+    die_with_error ("mknod %s", copy);
+
+  fd = open (copy, flags | O_CLOEXEC);
+  if (fd < 0)
+    die_with_error ("open %s", copy);
+
+  unlink (copy);
+  free (copy);
+
+  return fd;
+}
+
+static int
+is_checksum (const char *s)
+{
+  int i;
+
+  for (i = 0; i < 64; i++)
+    {
+      if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+        return 0;
+    }
+
+  return s[64] == 0;
+}
+
+/* Opens the image of a system deployment, which path must name as
+   XDG_APP_SYSTEMDIR/KIND/NAME/ARCH/BRANCH/CHECKSUM/files.squashfs.
+   The kernel can't safely mount crafted images, so nothing else is
+   accepted. Everything below XDG_APP_SYSTEMDIR is opened without
+   following symlinks, and must be owned and only writable by root,
+   so that the caller can neither point elsewhere nor swap files. */
+static int
+open_deploy_image (const char *path)
+{
+  const char *prefix = XDG_APP_SYSTEMDIR "/";
+  char *relpath, *component, *next;
+  struct stat st;
+  int fd, child_fd;
+  int depth;
+
+  if (strncmp (path, prefix, strlen (prefix)) != 0)
+    die ("Image %s is not in %s", path, XDG_APP_SYSTEMDIR);
+
+  fd = open (XDG_APP_SYSTEMDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    die_with_error ("open %s", XDG_APP_SYSTEMDIR);
+
+  relpath = xstrdup (path + strlen (prefix));
+
+  component = relpath;
+  for (depth = 0; component != NULL; depth++)
+    {
+      next = strchr (component, '/');
+      if (next != NULL)
+        *next++ = 0;
+
+      if (fstat (fd, &st) < 0)
+        die_with_error ("stat %s", path);
+
+      if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        die ("Image %s must be owned and only writable by root", path);
+
+      if (*component == 0 || strcmp (component, ".") == 0 || strcmp (component, "..") == 0 ||
+          (depth == 0 && strcmp (component, "app") != 0 && strcmp (component, "runtime") != 0) ||
+          (depth == 4 && !is_checksum (component)) ||
+          (depth == 5 && (next != NULL || strcmp (component, DEPLOY_IMAGE) != 0)) ||
+          (depth < 5 && next == NULL))
+        die ("%s is not the image of a deployment", path);
+
+      child_fd = openat (fd, component,
+                         O_RDONLY | O_NOFOLLOW | O_CLOEXEC | (next != NULL ? O_DIRECTORY : 0));
+      if (child_fd < 0)
+        die_with_error ("open %s", path);
+
+      close (fd);
+      fd = child_fd;
+      component = next;
+    }
+
+  if (fstat (fd, &st) < 0)
+    die_with_error ("stat %s", path);
+
+  if (!S_ISREG (st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    die ("Image %s must be owned and only writable by root", path);
+
+  free (relpath);
+
+  return fd;
+}
+
+/* Mounts the squashfs image of a system deployment at path read-only
+   on dest, through a loop device that is freed with the mount */
+static void
+mount_image (const char *path, const char *dest)
+{
+  struct loop_info64 info = { 0 };
+  char *loop_path = NULL;
+  int image_fd, control_fd;
+  int loop_fd = -1;
+  int n;
+
+  image_fd = open_deploy_image (path);
+
+  /* .oldroot is still empty, use it for the device nodes */
+  if (mount ("tmpfs", ".oldroot", "tmpfs", MS_NOSUID | MS_NOEXEC, "mode=700") != 0)
+    die_with_error ("mount tmpfs for loop devices");
+
+  control_fd = open_device_copy (".oldroot", "/dev/loop-control", O_RDWR);
+
+  while (loop_fd < 0)
+    {
+      n = ioctl (control_fd, LOOP_CTL_GET_FREE);
+      if (n < 0)
+        die_with_error ("Getting free loop device");
+
+      free (loop_path);
+      loop_path = strdup_printf ("/dev/loop%d", n);
+      loop_fd = open_device_copy (".oldroot", loop_path, O_RDONLY);
+
+      if (ioctl (loop_fd, LOOP_SET_FD, image_fd) < 0)
+        {
+          /* Someone else took it in the meantime */
+          if (errno != EBUSY)
+            die_with_error ("Setting up %s", loop_path);
+
+          close (loop_fd);
+          loop_fd = -1;
+        }
+    }
+
+  info.lo_flags = LO_FLAGS_AUTOCLEAR;
+  strncpy ((char *)info.lo_file_name, path, LO_NAME_SIZE - 1);
+  if (ioctl (loop_fd, LOOP_SET_STATUS64, &info) < 0)
+    {
+      ioctl (loop_fd, LOOP_CLR_FD, 0);
+      die_with_error ("Setting up %s", loop_path);
+    }
+
+  if (umount2 (".oldroot", MNT_DETACH) != 0)
+    die_with_error ("unmount tmpfs for loop devices");
+
+  if (mount (loop_path, dest, "squashfs", MS_MGC_VAL|MS_RDONLY|MS_NODEV|MS_NOSUID, NULL) != 0)
+    die_with_error ("mount %s", path);
+
+  if (mount ("none", dest, NULL, MS_REC|MS_PRIVATE, NULL) != 0)
+    die_with_error ("mount %s private", dest);
+
+  /* The mount keeps the loop device busy until it goes away */
+  close (loop_fd);
+  close (control_fd);
+  close (image_fd);
+  free (loop_path);
+}
+
+/* Mounts the directory or image src on dest */
+static void
+mount_tree (const char *src, const char *dest, int writable)
+{
+  if (is_image (src))
+    {
+      if (writable)
+        die ("Image %s can't be mounted writable", src);
+
+      mount_image (src, dest);
+    }
+  else if (bind_mount (src, dest, BIND_PRIVATE | (writable?0:BIND_READONLY)))
+    die_with_error ("mount %s", dest);
+}
+
 static int
 mkdir_with_parents (const char *pathname,
                     int         mode)
@@ -1417,16 +1616,14 @@ main (int argc,
         die_with_error ("mount /dev/shm");
     }
 
-  if (bind_mount (runtime_path, "usr", BIND_PRIVATE | (writable?0:BIND_READONLY)))
-    die_with_error ("mount usr");
+  mount_tree (runtime_path, "usr", writable);
 
   if (lock_files)
     add_lock_dir ("usr");
 
   if (app_path != NULL)
     {
-      if (bind_mount (app_path, "self", BIND_PRIVATE | (writable_app?0:BIND_READONLY)))
-        die_with_error ("mount self");
+      mount_tree (app_path, "self", writable_app);
 
       if (lock_files)
 	add_lock_dir ("self");
@@ -1444,8 +1641,7 @@ main (int argc,
 
   for (i = 0; i < n_extra_dirs; i++)
     {
-      if (bind_mount (extra_dirs_src[i], extra_dirs_dest[i], BIND_PRIVATE | BIND_READONLY))
-	die_with_error ("mount extra dir %s", extra_dirs_src[i]);
+      mount_tree (extra_dirs_src[i], extra_dirs_dest[i], 0);
 
       if (lock_files)
 	add_lock_dir (extra_dirs_dest[i]);
@@ -37,6 +37,8 @@ static XdgAppCommand commands[] = {
   { "build-finish", xdg_app_builtin_build_finish },
   { "build-export", xdg_app_builtin_build_export },
   { "repo-update", xdg_app_builtin_repo_update },
+  { "repair", xdg_app_builtin_repair },
+  { "rollback", xdg_app_builtin_rollback },
   { NULL }
 };
 
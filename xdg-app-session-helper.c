@@ -3,11 +3,19 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <gio/gio.h>
 #include "xdg-app-dbus.h"
+#include "xdg-app-dir.h"
 
 static GDBusNodeInfo *introspection_data = NULL;
 static char *monitor_dir;
+static XdgAppSessionHelper *helper;
+static GVariant *pending_updates;
+static gboolean prefetch_running;
+
+/* Seconds between checks for updates */
+#define PREFETCH_INTERVAL (6 * 60 * 60)
 
 static gboolean
 handle_request_monitor (XdgAppSessionHelper *object,
@@ -20,17 +28,133 @@ handle_request_monitor (XdgAppSessionHelper *object,
   return TRUE;
 }
 
+static gboolean
+handle_get_pending_updates (XdgAppSessionHelper *object,
+                            GDBusMethodInvocation *invocation,
+                            gpointer user_data)
+{
+  GVariant *updates = pending_updates;
+
+  if (updates == NULL)
+    updates = g_variant_new_array (G_VARIANT_TYPE ("(sss)"), NULL, 0);
+
+  xdg_app_session_helper_complete_get_pending_updates (object, invocation, updates);
+
+  return TRUE;
+}
+
+static void
+prefetch_dir (gboolean user,
+              GVariantBuilder *builder)
+{
+  GFile *path;
+  XdgAppDir *dir;
+  GHashTable *pending = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  GError *error = NULL;
+
+  if (user)
+    path = xdg_app_get_user_base_dir_location ();
+  else
+    path = xdg_app_get_system_base_dir_location ();
+  dir = xdg_app_dir_new (path, user);
+
+  /* The setting is read every time, so it applies without restarting
+     the helper */
+  if (!xdg_app_dir_get_prefetch_updates (dir, NULL))
+    g_debug ("Not checking for %s updates", user ? "user" : "system");
+  /* We can only write to the repo of the per-user installation, for
+     the system one we just look for updates */
+  else if (xdg_app_dir_prefetch_updates (dir, user, &pending, NULL, &error))
+    {
+      g_hash_table_iter_init (&iter, pending);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        g_variant_builder_add (builder, "(sss)", user ? "user" : "system",
+                               (char *)key, (char *)value);
+      g_hash_table_unref (pending);
+    }
+  else
+    {
+      g_message ("Failed to check for %s updates: %s",
+                 user ? "user" : "system", error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (dir);
+  g_object_unref (path);
+}
+
+static gboolean
+prefetch_done (gpointer data)
+{
+  GVariant *updates = data;
+
+  if (pending_updates)
+    g_variant_unref (pending_updates);
+  pending_updates = updates;
+
+  prefetch_running = FALSE;
+
+  if (helper)
+    xdg_app_session_helper_emit_pending_updates_changed (helper);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+prefetch_thread (gpointer data)
+{
+  GVariantBuilder builder;
+
+  /* This only affects the calling thread on Linux, so the D-Bus
+     interface stays responsive */
+  setpriority (PRIO_PROCESS, 0, 19);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sss)"));
+  prefetch_dir (TRUE, &builder);
+  prefetch_dir (FALSE, &builder);
+
+  g_idle_add (prefetch_done, g_variant_ref_sink (g_variant_builder_end (&builder)));
+
+  return NULL;
+}
+
+static void
+start_prefetch (void)
+{
+  if (prefetch_running)
+    return;
+
+  prefetch_running = TRUE;
+  g_thread_unref (g_thread_new ("prefetch", prefetch_thread, NULL));
+}
+
+static gboolean
+prefetch_timeout (gpointer data)
+{
+  start_prefetch ();
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+initial_prefetch_timeout (gpointer data)
+{
+  start_prefetch ();
+  return G_SOURCE_REMOVE;
+}
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
                  gpointer         user_data)
 {
-  XdgAppSessionHelper *helper;
   GError *error = NULL;
 
   helper = xdg_app_session_helper_skeleton_new ();
 
  g_signal_connect (helper, "handle-request-monitor", G_CALLBACK (handle_request_monitor), NULL);
+  g_signal_connect (helper, "handle-get-pending-updates", G_CALLBACK (handle_get_pending_updates), NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (helper),
 					 connection,
@@ -135,6 +259,10 @@ main (int    argc,
                              NULL,
                              NULL);
 
+  /* Give the session some time to start up before the first check */
+  g_timeout_add_seconds (60, initial_prefetch_timeout, NULL);
+  g_timeout_add_seconds (PREFETCH_INTERVAL, prefetch_timeout, NULL);
+
   loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (loop);
 
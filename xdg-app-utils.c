@@ -526,108 +526,619 @@ xdg_app_remove_dangling_symlinks (GFile    *dir,
   return ret;
 }
 
+static SoupSession *
+get_soup_session (void)
+{
+  static SoupSession *session = NULL;
+
+  if (session == NULL)
+    session = soup_session_new_with_options (SOUP_SESSION_USER_AGENT, PACKAGE_STRING,
+                                             NULL);
+
+  return session;
+}
+
+static void
+save_cached_contents (GFile       *cache_file,
+                      GFile       *cache_info_file,
+                      const char  *uri,
+                      SoupMessage *msg,
+                      GBytes      *contents)
+{
+  gs_unref_object GFile *cache_dir = NULL;
+  gs_unref_keyfile GKeyFile *cache_info = NULL;
+  gs_free char *cache_info_data = NULL;
+  gsize cache_info_len;
+  const char *etag;
+  const char *last_modified;
+  GError *temp_error = NULL;
+
+  etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  last_modified = soup_message_headers_get_one (msg->response_headers, "Last-Modified");
+
+  /* Without validators we could never revalidate the copy */
+  if (etag == NULL && last_modified == NULL)
+    return;
+
+  cache_info = g_key_file_new ();
+  g_key_file_set_string (cache_info, "Cache", "URI", uri);
+  if (etag)
+    g_key_file_set_string (cache_info, "Cache", "ETag", etag);
+  if (last_modified)
+    g_key_file_set_string (cache_info, "Cache", "Last-Modified", last_modified);
+  cache_info_data = g_key_file_to_data (cache_info, &cache_info_len, NULL);
+
+  /* The cache is only an optimization, e.g. a user can't write to the
+     cache of the system installation, so errors are not fatal */
+  cache_dir = g_file_get_parent (cache_file);
+  if (!gs_file_ensure_directory (cache_dir, TRUE, NULL, &temp_error) ||
+      !g_file_replace_contents (cache_file,
+                                g_bytes_get_data (contents, NULL), g_bytes_get_size (contents),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                NULL, &temp_error) ||
+      !g_file_replace_contents (cache_info_file,
+                                cache_info_data, cache_info_len,
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                NULL, &temp_error))
+    {
+      g_debug ("Not caching %s: %s", uri, temp_error->message);
+      g_error_free (temp_error);
+    }
+}
+
+/* Loads uri, using and updating a cached copy in cache_dir (if not NULL)
+   for http uris. The cached copy is revalidated with the ETag and
+   Last-Modified of the response it came from, and used as is if the
+   server can't be reached. */
 static gboolean
-load_contents (const char *uri, GBytes **contents, GCancellable *cancellable, GError **error)
+load_contents (const char *uri, GFile *cache_dir, GBytes **contents, GCancellable *cancellable, GError **error)
 {
   gboolean ret = FALSE;
   gs_free char *scheme = NULL;
 
   scheme = g_uri_parse_scheme (uri);
-  if (strcmp (scheme, "file") == 0)
+  if (scheme == NULL || strcmp (scheme, "file") == 0)
     {
-      char *buffer;
-      gsize length;
       gs_unref_object GFile *file = NULL;
+      GMappedFile *mfile;
 
-      g_debug ("Loading summary %s using GIO", uri);
-      file = g_file_new_for_uri (uri);
-      if (!g_file_load_contents (file, cancellable, &buffer, &length, NULL, NULL))
+      g_debug ("Loading summary %s using mmap", uri);
+      file = g_file_new_for_commandline_arg (uri);
+      mfile = g_mapped_file_new (gs_file_get_path_cached (file), FALSE, error);
+      if (mfile == NULL)
         goto out;
 
-      *contents = g_bytes_new_take (buffer, length);
+      *contents = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
     }
   else
     {
-      gs_unref_object SoupSession *session = NULL;
       gs_unref_object SoupMessage *msg = NULL;
+      gs_unref_object GFile *cache_file = NULL;
+      gs_unref_object GFile *cache_info_file = NULL;
+      gs_unref_keyfile GKeyFile *cache_info = NULL;
+      gs_unref_bytes GBytes *cached = NULL;
 
-      g_debug ("Loading summary %s using libsoup", uri);
-      session = soup_session_new ();
       msg = soup_message_new ("GET", uri);
-      soup_session_send_message (session, msg);
+      if (msg == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid uri %s", uri);
+          goto out;
+        }
 
-      if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
-        goto out;
+      if (cache_dir != NULL)
+        {
+          gs_free char *cache_name = NULL;
+          gs_free char *cache_info_name = NULL;
+          GMappedFile *mfile = NULL;
+
+          cache_name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uri, -1);
+          cache_info_name = g_strconcat (cache_name, ".info", NULL);
+          cache_file = g_file_get_child (cache_dir, cache_name);
+          cache_info_file = g_file_get_child (cache_dir, cache_info_name);
+
+          cache_info = g_key_file_new ();
+          if (g_key_file_load_from_file (cache_info, gs_file_get_path_cached (cache_info_file),
+                                         G_KEY_FILE_NONE, NULL) &&
+              (mfile = g_mapped_file_new (gs_file_get_path_cached (cache_file), FALSE, NULL)) != NULL)
+            {
+              gs_free char *etag = NULL;
+              gs_free char *last_modified = NULL;
+
+              /* The cache is replaced by renaming over it, so the mapping
+                 stays valid even if it is refreshed */
+              cached = g_mapped_file_get_bytes (mfile);
+              g_mapped_file_unref (mfile);
+
+              etag = g_key_file_get_string (cache_info, "Cache", "ETag", NULL);
+              if (etag)
+                soup_message_headers_append (msg->request_headers, "If-None-Match", etag);
+              last_modified = g_key_file_get_string (cache_info, "Cache", "Last-Modified", NULL);
+              if (last_modified)
+                soup_message_headers_append (msg->request_headers, "If-Modified-Since", last_modified);
+            }
+        }
+
+      g_debug ("Loading summary %s using libsoup", uri);
+      soup_session_send_message (get_soup_session (), msg);
+
+      if (cached != NULL && msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+        {
+          g_debug ("Summary %s not modified, using cached copy", uri);
+          *contents = g_bytes_ref (cached);
+        }
+      else if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+        {
+          *contents = g_bytes_new (msg->response_body->data, msg->response_body->length);
 
-      *contents = g_bytes_new (msg->response_body->data, msg->response_body->length);
+          if (cache_file != NULL)
+            save_cached_contents (cache_file, cache_info_file, uri, msg, *contents);
+        }
+      else if (cached != NULL && SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code))
+        {
+          g_message ("Can't load %s (%s), using cached copy", uri, msg->reason_phrase);
+          *contents = g_bytes_ref (cached);
+        }
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to load %s: %s", uri, msg->reason_phrase);
+          goto out;
+        }
     }
 
   ret = TRUE;
 
-  g_debug ("Received %ld bytes", g_bytes_get_size (*contents));
+  g_debug ("Received %" G_GSIZE_FORMAT " bytes", g_bytes_get_size (*contents));
 
 out:
   return ret;
 }
 
-gboolean
-ostree_repo_load_summary (const char *repository_url,
-                          GHashTable **refs,
-                          gchar **title,
-                          GCancellable *cancellable,
-                          GError **error)
+struct XdgAppSummary {
+  GBytes *bytes;
+  GVariant *summary;
+  GVariant *ref_list;
+  GVariant *extensions;
+  /* The serialized a(s(taya{sv})) ref list, see summary_get_ref() */
+  const guint8 *refs_data;
+  gsize refs_size;
+  gsize refs_offset_size;
+  gsize n_refs;
+};
+
+/* The size of the framing offsets in a serialized GVariant container
+   of the given size */
+static gsize
+gvariant_offset_size (gsize container_size)
 {
-  gboolean ret = FALSE;
+  if (container_size == 0)
+    return 0;
+  if (container_size <= G_MAXUINT8)
+    return 1;
+  if (container_size <= G_MAXUINT16)
+    return 2;
+  if (container_size <= G_MAXUINT32)
+    return 4;
+  return 8;
+}
+
+static gsize
+gvariant_read_offset (const guint8 *data,
+                      gsize offset_size)
+{
+  gsize offset = 0;
+  gsize i;
+
+  /* Framing offsets are little endian */
+  for (i = 0; i < offset_size; i++)
+    offset |= (gsize)data[i] << (8 * i);
+
+  return offset;
+}
+
+/* Loads the summary of the remote at repository_url. Local and cached
+   summaries are mmapped, and the variant refers directly to the mapped
+   bytes, so nothing is copied or parsed up front. */
+XdgAppSummary *
+xdg_app_summary_load (const char *repository_url,
+                      GFile *cache_dir,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  XdgAppSummary *summary = NULL;
   gs_free char *summary_url = NULL;
   gs_unref_bytes GBytes *bytes = NULL;
-  gs_unref_hashtable GHashTable *local_refs = NULL;
-  gs_free char *local_title = NULL;
 
   summary_url = g_build_filename (repository_url, "summary", NULL);
-  if (load_contents (summary_url, &bytes, cancellable, NULL))
+  if (!load_contents (summary_url, cache_dir, &bytes, cancellable, error))
+    return NULL;
+
+  summary = g_new0 (XdgAppSummary, 1);
+  summary->bytes = g_bytes_ref (bytes);
+  summary->summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                                   bytes, FALSE));
+  summary->ref_list = g_variant_get_child_value (summary->summary, 0);
+  summary->extensions = g_variant_get_child_value (summary->summary, 1);
+
+  /* The array ends with the end offsets of its elements, the last of
+     which is where the offsets start */
+  summary->refs_data = g_variant_get_data (summary->ref_list);
+  summary->refs_size = g_variant_get_size (summary->ref_list);
+  summary->refs_offset_size = gvariant_offset_size (summary->refs_size);
+  if (summary->refs_size > 0)
     {
-      gs_unref_variant GVariant *summary;
-      gs_unref_variant GVariant *ref_list;
-      gs_unref_variant GVariant *extensions;
-      GVariantDict dict;
-      int i, n;
+      gsize offsets_start;
 
-      local_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      offsets_start = gvariant_read_offset (summary->refs_data + summary->refs_size - summary->refs_offset_size,
+                                            summary->refs_offset_size);
+      if (offsets_start <= summary->refs_size &&
+          (summary->refs_size - offsets_start) % summary->refs_offset_size == 0)
+        summary->n_refs = (summary->refs_size - offsets_start) / summary->refs_offset_size;
+    }
 
-      summary = g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE);
-      ref_list = g_variant_get_child_value (summary, 0);
-      extensions = g_variant_get_child_value (summary, 1);
+  g_debug ("Summary contains %" G_GSIZE_FORMAT " refs", summary->n_refs);
 
-      n = g_variant_n_children (ref_list);
-      g_debug ("Summary contains %d refs", n);
-      for (i = 0; i < n; i++)
-        {
-          gs_unref_variant GVariant *ref = NULL;
-          gs_unref_variant GVariant *csum_v = NULL;
-          char *refname;
-          char *checksum;
+  return summary;
+}
+
+void
+xdg_app_summary_free (XdgAppSummary *summary)
+{
+  if (summary == NULL)
+    return;
+
+  g_variant_unref (summary->extensions);
+  g_variant_unref (summary->ref_list);
+  g_variant_unref (summary->summary);
+  g_bytes_unref (summary->bytes);
+  g_free (summary);
+}
+
+/* The returned pointers point into the summary data. The checksum is
+   NULL if it is malformed, and the name is "" if the ref is, like
+   GVariant would return.
+
+   This runs for every probe of a lookup and every step of an
+   iteration, so the serialized (s(taya{sv})) is read directly instead
+   of allocating a GVariant for each level. The end offset of the name
+   is at the end of the ref, and the checksum follows the guint64 in the
+   inner tuple, which ends with the end offset of the checksum. */
+static const char *
+summary_get_ref (XdgAppSummary *summary,
+                 gsize i,
+                 const guint8 **out_csum)
+{
+  const guint8 *offsets;
+  const guint8 *ref;
+  gsize start, end, size, offset_size;
+  gsize name_end, inner_start, inner_size, inner_offset_size, csum_end;
+
+  if (out_csum)
+    *out_csum = NULL;
+
+  offsets = summary->refs_data + summary->refs_size - summary->n_refs * summary->refs_offset_size;
+  end = gvariant_read_offset (offsets + i * summary->refs_offset_size, summary->refs_offset_size);
+  start = 0;
+  if (i > 0)
+    {
+      /* The refs are aligned to 8 bytes, for the guint64 */
+      start = gvariant_read_offset (offsets + (i - 1) * summary->refs_offset_size, summary->refs_offset_size);
+      start = (start + 7) & ~(gsize)7;
+    }
+  if (start > end || end > (gsize)(offsets - summary->refs_data))
+    return "";
+
+  ref = summary->refs_data + start;
+  size = end - start;
+  offset_size = gvariant_offset_size (size);
+  if (size < offset_size)
+    return "";
+
+  name_end = gvariant_read_offset (ref + size - offset_size, offset_size);
+  if (name_end == 0 || name_end > size - offset_size || ref[name_end - 1] != '\0')
+    return "";
+
+  if (out_csum)
+    {
+      const guint8 *inner;
+
+      inner_start = (name_end + 7) & ~(gsize)7;
+      if (inner_start > size - offset_size)
+        return (const char *)ref;
+
+      inner = ref + inner_start;
+      inner_size = size - offset_size - inner_start;
+      inner_offset_size = gvariant_offset_size (inner_size);
+      if (inner_size < 8 + inner_offset_size)
+        return (const char *)ref;
+
+      csum_end = gvariant_read_offset (inner + inner_size - inner_offset_size, inner_offset_size);
+      if (csum_end >= 8 && csum_end <= inner_size - inner_offset_size &&
+          csum_end - 8 == 32)
+        *out_csum = inner + 8;
+    }
 
-          ref = g_variant_get_child_value (ref_list, i);
-          g_variant_get (ref, "(&s(t@aya{sv}))", &refname, NULL, &csum_v, NULL);
+  return (const char *)ref;
+}
+
+/* Returns the index of the first ref that is not less than key. The refs
+   in a summary are sorted by ostree. */
+static gsize
+summary_lower_bound (XdgAppSummary *summary,
+                     const char *key)
+{
+  gsize lo = 0, hi = summary->n_refs;
 
-          if (!ostree_validate_rev (refname, error))
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (strcmp (summary_get_ref (summary, mid, NULL), key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* Looks up the binary checksum of ref. It points into the summary data
+   and is valid as long as the summary. */
+gboolean
+xdg_app_summary_lookup_ref (XdgAppSummary *summary,
+                            const char *ref,
+                            const guint8 **out_csum)
+{
+  gsize i;
+  const guint8 *csum;
+
+  i = summary_lower_bound (summary, ref);
+  if (i == summary->n_refs ||
+      strcmp (summary_get_ref (summary, i, &csum), ref) != 0 ||
+      csum == NULL)
+    return FALSE;
+
+  *out_csum = csum;
+  return TRUE;
+}
+
+void
+xdg_app_summary_iter_init (XdgAppSummaryIter *iter,
+                           XdgAppSummary *summary,
+                           const char *prefix)
+{
+  iter->summary = summary;
+  iter->prefix = prefix ? prefix : "";
+  iter->pos = summary_lower_bound (summary, iter->prefix);
+}
+
+/* Returns the next ref starting with the prefix of the iter, in sorted
+   order. Like with lookups, ref and csum point into the summary data. */
+gboolean
+xdg_app_summary_iter_next (XdgAppSummaryIter *iter,
+                           const char **out_ref,
+                           const guint8 **out_csum)
+{
+  while (iter->pos < iter->summary->n_refs)
+    {
+      const char *ref;
+      const guint8 *csum;
+
+      ref = summary_get_ref (iter->summary, iter->pos++, &csum);
+      if (!g_str_has_prefix (ref, iter->prefix))
+        break;
+
+      if (csum == NULL)
+        continue;
+
+      *out_ref = ref;
+      *out_csum = csum;
+      return TRUE;
+    }
+
+  iter->pos = iter->summary->n_refs;
+  return FALSE;
+}
+
+/* Returns whether the remote publishes a static delta from the commit
+   from (or from scratch, if NULL) to the commit to */
+gboolean
+xdg_app_summary_has_static_delta (XdgAppSummary *summary,
+                                  const char *from,
+                                  const char *to)
+{
+  gs_unref_variant GVariant *deltas = NULL;
+  gs_unref_variant GVariant *delta = NULL;
+  gs_free char *name = NULL;
+
+  if (from)
+    name = g_strconcat (from, "-", to, NULL);
+  else
+    name = g_strdup (to);
+
+  /* Listed by ostree when regenerating the summary */
+  deltas = xdg_app_summary_lookup_extension (summary, "ostree.static-deltas", G_VARIANT_TYPE_VARDICT);
+  if (deltas == NULL)
+    return FALSE;
+
+  delta = g_variant_lookup_value (deltas, name, NULL);
+
+  return delta != NULL;
+}
+
+/* Returns the value of key in the summary extensions, if it has the
+   right type */
+GVariant *
+xdg_app_summary_lookup_extension (XdgAppSummary *summary,
+                                  const char *key,
+                                  const GVariantType *type)
+{
+  return g_variant_lookup_value (summary->extensions, key, type);
+}
+
+/* Looks up the sizes that xdg-app repo-update records in the summary */
+gboolean
+xdg_app_summary_lookup_sizes (XdgAppSummary *summary,
+                              const char *ref,
+                              guint64 *out_installed_size,
+                              guint64 *out_download_size)
+{
+  gs_unref_variant GVariant *sizes = NULL;
+  guint64 installed_size, download_size;
+
+  sizes = xdg_app_summary_lookup_extension (summary, "xa.sizes", G_VARIANT_TYPE ("a{s(tt)}"));
+  if (sizes == NULL ||
+      !g_variant_lookup (sizes, ref, "(tt)", &installed_size, &download_size))
+    return FALSE;
+
+  *out_installed_size = GUINT64_FROM_BE (installed_size);
+  *out_download_size = GUINT64_FROM_BE (download_size);
+  return TRUE;
+}
+
+/* Adds the sizes recorded by xdg-app build-export to the commit metadata.
+   Like the other numbers in commits they are big endian. */
+void
+xdg_app_commit_metadata_add_sizes (GVariantBuilder *metadata,
+                                   guint64 installed_size,
+                                   guint64 download_size)
+{
+  g_variant_builder_add (metadata, "{sv}", "xa.installed-size",
+                         g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
+  g_variant_builder_add (metadata, "{sv}", "xa.download-size",
+                         g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+}
+
+gboolean
+xdg_app_commit_get_sizes (GVariant *commit,
+                          guint64 *out_installed_size,
+                          guint64 *out_download_size)
+{
+  gs_unref_variant GVariant *metadata = NULL;
+  guint64 installed_size, download_size;
+
+  metadata = g_variant_get_child_value (commit, 0);
+  if (!g_variant_lookup (metadata, "xa.installed-size", "t", &installed_size) ||
+      !g_variant_lookup (metadata, "xa.download-size", "t", &download_size))
+    return FALSE;
+
+  *out_installed_size = GUINT64_FROM_BE (installed_size);
+  *out_download_size = GUINT64_FROM_BE (download_size);
+  return TRUE;
+}
+
+static gboolean
+add_object_size (OstreeRepo *repo,
+                 OstreeObjectType objtype,
+                 const char *checksum,
+                 GHashTable *seen,
+                 guint64 *download_size,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+  char *key;
+  guint64 size;
+
+  key = ostree_object_to_string (checksum, objtype);
+  if (g_hash_table_contains (seen, key))
+    {
+      g_free (key);
+      return TRUE;
+    }
+  g_hash_table_add (seen, key);
+
+  if (!ostree_repo_query_object_storage_size (repo, objtype, checksum, &size,
+                                              cancellable, error))
+    return FALSE;
+
+  *download_size += size;
+  return TRUE;
+}
+
+static gboolean
+collect_sizes (OstreeRepo *repo,
+               GFile *dir,
+               GHashTable *seen,
+               guint64 *installed_size,
+               guint64 *download_size,
+               GCancellable *cancellable,
+               GError **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_object GFileInfo *child_info = NULL;
+  GError *temp_error = NULL;
+
+  if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (dir), error))
+    goto out;
+
+  if (!add_object_size (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                        ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (dir)),
+                        seen, download_size, cancellable, error) ||
+      !add_object_size (repo, OSTREE_OBJECT_TYPE_DIR_META,
+                        ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (dir)),
+                        seen, download_size, cancellable, error))
+    goto out;
+
+  dir_enum = g_file_enumerate_children (dir, "standard::name,standard::type,standard::size",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable,
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      gs_unref_object GFile *child = g_file_get_child (dir, g_file_info_get_name (child_info));
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!collect_sizes (repo, child, seen, installed_size, download_size, cancellable, error))
             goto out;
+        }
+      else
+        {
+          *installed_size += g_file_info_get_size (child_info);
 
-          checksum = ostree_checksum_from_bytes_v (csum_v);
-          g_debug ("\t%s -> %s", refname, checksum);
-          g_hash_table_insert (local_refs, g_strdup (refname), checksum);
+          if (!add_object_size (repo, OSTREE_OBJECT_TYPE_FILE,
+                                ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child)),
+                                seen, download_size, cancellable, error))
+            goto out;
         }
 
-       g_variant_dict_init (&dict, extensions);
-       g_variant_dict_lookup (&dict, "xa.title", "s", &local_title);
-       g_debug ("Summary title: %s", local_title);
-       g_variant_dict_end (&dict);
+      g_clear_object (&child_info);
     }
 
-  *refs = g_hash_table_ref (local_refs);
-  *title = g_strdup (local_title);
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
 
   ret = TRUE;
-out:
+ out:
   return ret;
 }
+
+/* Computes the size of the files in the tree at root once checked out,
+   and the stored size of all the objects in it, which for an archive
+   repository is roughly what a pull without deltas downloads */
+gboolean
+xdg_app_repo_collect_sizes (OstreeRepo *repo,
+                            GFile *root,
+                            guint64 *out_installed_size,
+                            guint64 *out_download_size,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  gs_unref_hashtable GHashTable *seen = NULL;
+
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  *out_installed_size = 0;
+  *out_download_size = 0;
+
+  return collect_sizes (repo, root, seen, out_installed_size, out_download_size,
+                        cancellable, error);
+}
@@ -39,11 +39,51 @@ gboolean xdg_app_remove_dangling_symlinks (GFile    *dir,
                                            GCancellable  *cancellable,
                                            GError       **error);
 
-gboolean ostree_repo_load_summary (const char *repository_url,
-                                   GHashTable **refs,
-                                   gchar **title,
-                                   GCancellable *cancellable,
-                                   GError **error);
+typedef struct XdgAppSummary XdgAppSummary;
+
+typedef struct {
+  XdgAppSummary *summary;
+  const char *prefix;
+  gsize pos;
+} XdgAppSummaryIter;
+
+XdgAppSummary * xdg_app_summary_load (const char *repository_url,
+                                      GFile *cache_dir,
+                                      GCancellable *cancellable,
+                                      GError **error);
+void xdg_app_summary_free (XdgAppSummary *summary);
+gboolean xdg_app_summary_lookup_ref (XdgAppSummary *summary,
+                                     const char *ref,
+                                     const guint8 **out_csum);
+void xdg_app_summary_iter_init (XdgAppSummaryIter *iter,
+                                XdgAppSummary *summary,
+                                const char *prefix);
+gboolean xdg_app_summary_iter_next (XdgAppSummaryIter *iter,
+                                    const char **out_ref,
+                                    const guint8 **out_csum);
+gboolean xdg_app_summary_has_static_delta (XdgAppSummary *summary,
+                                           const char *from,
+                                           const char *to);
+GVariant * xdg_app_summary_lookup_extension (XdgAppSummary *summary,
+                                             const char *key,
+                                             const GVariantType *type);
+gboolean xdg_app_summary_lookup_sizes (XdgAppSummary *summary,
+                                       const char *ref,
+                                       guint64 *out_installed_size,
+                                       guint64 *out_download_size);
+
+void xdg_app_commit_metadata_add_sizes (GVariantBuilder *metadata,
+                                        guint64 installed_size,
+                                        guint64 download_size);
+gboolean xdg_app_commit_get_sizes (GVariant *commit,
+                                   guint64 *out_installed_size,
+                                   guint64 *out_download_size);
+gboolean xdg_app_repo_collect_sizes (OstreeRepo *repo,
+                                     GFile *root,
+                                     guint64 *out_installed_size,
+                                     guint64 *out_download_size,
+                                     GCancellable *cancellable,
+                                     GError **error);
 
 #if !GLIB_CHECK_VERSION(2,43,1)
 static inline  gboolean